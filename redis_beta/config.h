@@ -0,0 +1,14 @@
+#ifndef __CONFIG_H
+#define __CONFIG_H
+
+/* Test for polling API */
+#ifdef __linux__
+#define HAVE_EPOLL 1
+#endif
+
+/* io_uring is opt-in, build with "make USE_IOURING=yes" to enable it */
+#if defined(__linux__) && defined(USE_IOURING)
+#define HAVE_IO_URING 1
+#endif
+
+#endif /* __CONFIG_H */
@@ -12,6 +12,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <ctype.h>
 #include "dict.h"
 
 /* ---------------------------- Utility functions --------------------------- */
@@ -383,3 +384,10 @@ unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
     while (len--) hash = ((hash << 5) + hash) + (*buf++); /* hash * 33 + c */
     return hash;
 }
+
+/* And a case insensitive version of it */
+unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len) {
+    unsigned int hash = 5381;
+    while (len--) hash = ((hash << 5) + hash) + tolower(*buf++); /* hash * 33 + c */
+    return hash;
+}
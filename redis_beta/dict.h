@@ -90,5 +90,6 @@ void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomEntry(dict *ht);
 void dictPrintStats(dict *ht);
 unsigned int dictGenHashFunction(const unsigned char *buf, int len);
+unsigned int dictGenCaseHashFunction(const unsigned char *buf, int len);
 
 #endif /* __DICT_H */
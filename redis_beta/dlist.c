@@ -98,6 +98,45 @@ void listDelNode(list *list, listNode *node)
     list->len--;
 }
 
+/* Remove the node from the list without freeing it, so that it can be
+ * added again with listLinkNodeTail(). */
+void listUnlinkNode(list *list, listNode *node)
+{
+    if (node->prev) node->prev->next = node->next;
+    else list->head = node->next;
+    if (node->next) node->next->prev = node->prev;
+    else list->tail = node->prev;
+    node->prev = node->next = NULL;
+    list->len--;
+}
+
+/* Add an unlinked node at the tail of the list */
+void listLinkNodeTail(list *list, listNode *node)
+{
+    node->prev = list->tail;
+    node->next = NULL;
+    if (list->tail) list->tail->next = node;
+    else list->head = node;
+    list->tail = node;
+    list->len++;
+}
+
+/* Move the tail node to the head of the list. Used to visit a list a
+ * few elements at a time in a round robin fashion. */
+void listRotate(list *list)
+{
+    listNode *tail = list->tail;
+    if (listLength(list) <= 1) return;
+    /* Detach current tail */
+    list->tail = tail->prev;
+    list->tail->next = NULL;
+    /* Move it as head */
+    list->head->prev = tail;
+    tail->prev = NULL;
+    tail->next = list->head;
+    list->head = tail;
+}
+
 /* Returns a list iterator 'iter'. After the initialization every
  * call to listNextElement() will return the next element of the list.
  *
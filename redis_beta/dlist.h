@@ -50,11 +50,14 @@ void listRelease(list *list);
 list *listAddNodeHead(list *list, void *value);
 list *listAddNodeTail(list *list, void *value);
 void listDelNode(list *list, listNode *node);
+void listUnlinkNode(list *list, listNode *node);
+void listLinkNodeTail(list *list, listNode *node);
 listIter *listGetIterator(list *list, int direction);
 void listReleaseIterator(listIter *iter);
 listNode *listNextElement(listIter *iter);
 listNode *listSearchKey(list *list, void *value);
 listNode *listIndex(list *list, int index);
+void listRotate(list *list);
 
 /* Directions for iterators */
 #define DL_START_HEAD 0
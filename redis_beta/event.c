@@ -11,127 +11,285 @@
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include "config.h"
+
+/* Include the best polling backend this system supports. Every backend
+ * implements the same static eApi*() interface on top of the fd-indexed
+ * slots kept in eEventLoop. */
+#if defined(HAVE_IO_URING)
+#include "event_iouring.c"
+#elif defined(HAVE_EPOLL)
+#include "event_epoll.c"
+#else
+#include "event_select.c"
+#endif
 
 eEventLoop *eCreateEventLoop(void)
 {
     eEventLoop *eventLoop = malloc(sizeof(struct eEventLoop));
     if (!eventLoop) return NULL;
-    eventLoop->fileEventHead = NULL;
-    eventLoop->timeEventHead = NULL;
+    eventLoop->setsize = E_SETSIZE_INITIAL;
+    eventLoop->events = malloc(sizeof(eFileEvent)*eventLoop->setsize);
+    eventLoop->fired = malloc(sizeof(eFiredEvent)*eventLoop->setsize);
+    if (!eventLoop->events || !eventLoop->fired || eApiCreate(eventLoop) == -1) {
+        free(eventLoop->events);
+        free(eventLoop->fired);
+        free(eventLoop);
+        return NULL;
+    }
+    /* Events with mask == E_NONE are not set. So let's initialize the
+     * vector with it. */
+    for (int j = 0; j < eventLoop->setsize; j++) eventLoop->events[j].mask = E_NONE;
+    eventLoop->maxfd = -1;
+    eventLoop->timeHeap = NULL;
+    eventLoop->timeHeapLen = eventLoop->timeHeapSize = 0;
+    eventLoop->timeTable = NULL;
+    eventLoop->timeTableSize = 0;
     eventLoop->timeEventNextId = 0;
+    eventLoop->beforesleep = NULL;
+    eventLoop->aftersleep = NULL;
+    eventLoop->stallThreshold = 0;
+    eventLoop->stallProc = NULL;
+    eResetStats(eventLoop);
     eventLoop->stop = 0;
     return eventLoop;
 }
 
 void eDeleteEventLoop(eEventLoop *eventLoop)
 {
+    for (int j = 0; j < eventLoop->timeHeapLen; j++) free(eventLoop->timeHeap[j]);
+    free(eventLoop->timeHeap);
+    free(eventLoop->timeTable);
+    eApiFree(eventLoop);
+    free(eventLoop->events);
+    free(eventLoop->fired);
     free(eventLoop);
 }
 
+/* Make the loop able to track 'fd', growing the per-fd state by powers
+ * of two. Returns E_ERR if the backend can't handle such a descriptor
+ * (i.e. select() and fd >= FD_SETSIZE) or on out of memory. */
+static int eMakeRoomForFd(eEventLoop *eventLoop, int fd)
+{
+    if (fd < eventLoop->setsize) return E_OK;
+    int setsize = eventLoop->setsize;
+    while (setsize <= fd) setsize *= 2;
+    if (eApiResize(eventLoop, setsize) == -1) return E_ERR;
+    eFileEvent *events = realloc(eventLoop->events, sizeof(eFileEvent)*setsize);
+    if (!events) return E_ERR;
+    eventLoop->events = events;
+    eFiredEvent *fired = realloc(eventLoop->fired, sizeof(eFiredEvent)*setsize);
+    if (!fired) return E_ERR;
+    eventLoop->fired = fired;
+    for (int j = eventLoop->setsize; j < setsize; j++) eventLoop->events[j].mask = E_NONE;
+    eventLoop->setsize = setsize;
+    return E_OK;
+}
+
 int eCreateFileEvent(eEventLoop *eventLoop, int fd, int mask, eFileProc *proc,
 		void *clientData, eEventFinalizerProc *finalizerProc)
 {
-    eFileEvent *fe = malloc(sizeof(struct eFileEvent));
-    if (fe == NULL) return E_ERR;
-    fe->fd = fd;
-    fe->mask = mask;
-    fe->fileProc = proc;
+    if (eMakeRoomForFd(eventLoop, fd) == E_ERR) return E_ERR;
+    if (eApiAddEvent(eventLoop, fd, mask) == -1) return E_ERR;
+    eFileEvent *fe = &eventLoop->events[fd];
+    fe->mask |= mask;
+    if (mask & E_READABLE) fe->rfileProc = proc;
+    if (mask & E_WRITABLE) fe->wfileProc = proc;
     fe->finalizerProc = finalizerProc;
     fe->clientData = clientData;
-    fe->next = eventLoop->fileEventHead;
-    eventLoop->fileEventHead = fe;
+    if (fd > eventLoop->maxfd) eventLoop->maxfd = fd;
     return E_OK;
 }
 
 void eDeleteFileEvent(eEventLoop *eventLoop, int fd, int mask)
 {
-    eFileEvent *fe = eventLoop->fileEventHead, *prev = NULL;
-    while (fe) {
-        if (fe->fd==fd && fe->mask==mask) {
-            if (prev == NULL) eventLoop->fileEventHead = fe->next;
-            else prev->next = fe->next;
-            if (fe->finalizerProc) fe->finalizerProc(eventLoop, fe->clientData);
-            free(fe);
-            return;
-        }
-        prev = fe;
-        fe = fe->next;
+    if (fd >= eventLoop->setsize) return;
+    eFileEvent *fe = &eventLoop->events[fd];
+    if (!(fe->mask & mask)) return;
+    eApiDelEvent(eventLoop, fd, mask);
+    fe->mask = fe->mask & (~mask);
+    if (fe->mask != E_NONE) return;
+    if (fd == eventLoop->maxfd) {
+        /* Update the max fd */
+        int j;
+        for (j = eventLoop->maxfd-1; j >= 0; j--)
+            if (eventLoop->events[j].mask != E_NONE) break;
+        eventLoop->maxfd = j;
     }
+    if (fe->finalizerProc) fe->finalizerProc(eventLoop, fe->clientData);
 }
 
-static void eGetTime(long *seconds, long *milliseconds)
+/* Time events are kept in a binary min-heap ordered by deadline, so the
+ * nearest timer is always at index 0 and insert/cancel are O(log N).
+ * Deadlines use the monotonic clock, so wall clock jumps (NTP, date -s)
+ * don't make timers fire early or stall.
+ *
+ * Since timers are cancelled by ID, an ID -> event hash table is kept as
+ * well. IDs are sequential, so the low bits are used directly as the
+ * bucket index. */
+long long eGetMonotonicNs(void)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec / 1000;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec)*1000000000LL + ts.tv_nsec;
 }
 
-static void eAddMillisecondsToNow(long long milliseconds, long *sec, long *ms)
+static void eTimeHeapSet(eEventLoop *eventLoop, int index, eTimeEvent *te)
 {
-    long cur_sec, cur_ms;
-    eGetTime(&cur_sec, &cur_ms);
-    long when_sec = cur_sec + milliseconds/1000;
-    long when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec++;
-        when_ms -= 1000;
+    eventLoop->timeHeap[index] = te;
+    te->heapIndex = index;
+}
+
+static void eTimeHeapUp(eEventLoop *eventLoop, int index)
+{
+    eTimeEvent *te = eventLoop->timeHeap[index];
+    while (index > 0) {
+        int parent = (index-1)/2;
+        if (eventLoop->timeHeap[parent]->when <= te->when) break;
+        eTimeHeapSet(eventLoop, index, eventLoop->timeHeap[parent]);
+        index = parent;
+    }
+    eTimeHeapSet(eventLoop, index, te);
+}
+
+static void eTimeHeapDown(eEventLoop *eventLoop, int index)
+{
+    eTimeEvent *te = eventLoop->timeHeap[index];
+    int len = eventLoop->timeHeapLen;
+    while (1) {
+        int child = index*2+1;
+        if (child >= len) break;
+        if (child+1 < len && eventLoop->timeHeap[child+1]->when < eventLoop->timeHeap[child]->when)
+            child++;
+        if (te->when <= eventLoop->timeHeap[child]->when) break;
+        eTimeHeapSet(eventLoop, index, eventLoop->timeHeap[child]);
+        index = child;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+    eTimeHeapSet(eventLoop, index, te);
+}
+
+/* Restore the heap property after the deadline of 'te' changed. */
+static void eTimeHeapFix(eEventLoop *eventLoop, eTimeEvent *te)
+{
+    eTimeHeapUp(eventLoop, te->heapIndex);
+    eTimeHeapDown(eventLoop, te->heapIndex);
+}
+
+static int eTimeHeapInsert(eEventLoop *eventLoop, eTimeEvent *te)
+{
+    if (eventLoop->timeHeapLen == eventLoop->timeHeapSize) {
+        int size = eventLoop->timeHeapSize ? eventLoop->timeHeapSize*2 : 16;
+        eTimeEvent **heap = realloc(eventLoop->timeHeap, sizeof(eTimeEvent*)*size);
+        if (!heap) return E_ERR;
+        eventLoop->timeHeap = heap;
+        eventLoop->timeHeapSize = size;
+    }
+    eTimeHeapSet(eventLoop, eventLoop->timeHeapLen++, te);
+    eTimeHeapUp(eventLoop, te->heapIndex);
+    return E_OK;
+}
+
+static void eTimeHeapRemove(eEventLoop *eventLoop, eTimeEvent *te)
+{
+    eTimeEvent *last = eventLoop->timeHeap[--eventLoop->timeHeapLen];
+    if (last == te) return;
+    eTimeHeapSet(eventLoop, te->heapIndex, last);
+    eTimeHeapFix(eventLoop, last);
+}
+
+static eTimeEvent *eTimeLookup(eEventLoop *eventLoop, long long id)
+{
+    if (eventLoop->timeTableSize == 0) return NULL;
+    eTimeEvent *te = eventLoop->timeTable[id & (eventLoop->timeTableSize-1)];
+    while (te && te->id != id) te = te->idNext;
+    return te;
+}
+
+/* Grow the ID table so that there is at least one bucket per timer. */
+static int eTimeTableExpand(eEventLoop *eventLoop)
+{
+    unsigned long size = eventLoop->timeTableSize ? eventLoop->timeTableSize*2 : 16;
+    eTimeEvent **table = calloc(size, sizeof(eTimeEvent*));
+    if (!table) return E_ERR;
+    for (unsigned long j = 0; j < eventLoop->timeTableSize; j++) {
+        eTimeEvent *te = eventLoop->timeTable[j];
+        while (te) {
+            eTimeEvent *next = te->idNext;
+            unsigned long h = te->id & (size-1);
+            te->idNext = table[h];
+            table[h] = te;
+            te = next;
+        }
+    }
+    free(eventLoop->timeTable);
+    eventLoop->timeTable = table;
+    eventLoop->timeTableSize = size;
+    return E_OK;
+}
+
+static void eTimeTableUnlink(eEventLoop *eventLoop, eTimeEvent *te)
+{
+    eTimeEvent **p = &eventLoop->timeTable[te->id & (eventLoop->timeTableSize-1)];
+    while (*p != te) p = &(*p)->idNext;
+    *p = te->idNext;
 }
 
 long long eCreateTimeEvent(eEventLoop *eventLoop, long long milliseconds,
         eTimeProc *proc, void *clientData, eEventFinalizerProc *finalizerProc)
 {
+    if ((unsigned long)eventLoop->timeHeapLen >= eventLoop->timeTableSize &&
+        eTimeTableExpand(eventLoop) == E_ERR) return E_ERR;
     eTimeEvent *te = malloc(sizeof(struct eTimeEvent));
     if (te == NULL) return E_ERR;
     te->id = eventLoop->timeEventNextId++;
-    eAddMillisecondsToNow(milliseconds, &te->when_sec, &te->when_ms);
+    te->when = eGetMonotonicNs() + milliseconds*1000000;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
+    if (eTimeHeapInsert(eventLoop, te) == E_ERR) {
+        free(te);
+        return E_ERR;
+    }
+    unsigned long h = te->id & (eventLoop->timeTableSize-1);
+    te->idNext = eventLoop->timeTable[h];
+    eventLoop->timeTable[h] = te;
     return te->id;
 }
 
 int eDeleteTimeEvent(eEventLoop *eventLoop, long long id)
 {
-    eTimeEvent *te = eventLoop->timeEventHead, *prev = NULL;
-    while (te) {
-        if (te->id == id) {
-            if (prev == NULL) eventLoop->timeEventHead = te->next;
-            else prev->next = te->next;
-            if (te->finalizerProc) te->finalizerProc(eventLoop, te->clientData);
-            free(te);
-            return E_OK;
-        }
-        prev = te;
-        te = te->next;
-    }
-    return E_ERR; /* NO event with the specified ID found */
+    eTimeEvent *te = eTimeLookup(eventLoop, id);
+    if (te == NULL) return E_ERR; /* NO event with the specified ID found */
+    eTimeHeapRemove(eventLoop, te);
+    eTimeTableUnlink(eventLoop, te);
+    if (te->finalizerProc) te->finalizerProc(eventLoop, te->clientData);
+    free(te);
+    return E_OK;
 }
 
-/* Search the first timer to fire.
- * This operation is useful to know how many time the select can be
- * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted. */
-static eTimeEvent *eSearchNearestTimer(eEventLoop *eventLoop)
+/* Account the run time of a single callback, started at 'start', and
+ * report it as a stall when it exceeds the configured threshold.
+ * 'fd' is -1 for time events, 'id' is -1 for file events. */
+static void eTrackCallback(eEventLoop *eventLoop, latencyHist *h, long long start,
+        int fd, long long id)
 {
-    eTimeEvent *te = eventLoop->timeEventHead;
-    eTimeEvent *nearest = NULL;
-    while (te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-        	(te->when_sec == nearest->when_sec && te->when_ms < nearest->when_ms))
-        	nearest = te;
-        te = te->next;
+    long long usec = (eGetMonotonicNs() - start) / 1000;
+    latencyHistAdd(h, usec);
+    if (eventLoop->stallThreshold && usec >= eventLoop->stallThreshold) {
+        eventLoop->stats.stalls++;
+        if (eventLoop->stallProc) eventLoop->stallProc(eventLoop, fd, id, usec);
     }
-    return nearest;
+}
+
+/* Account a file event callback the program ran itself, started at
+ * 'start' (see eGetMonotonicNs()), like the ones run by eProcessEvents().
+ * I.e. the reads of an fd deferred to the before sleep callback. */
+void eTrackFileEvent(eEventLoop *eventLoop, int fd, long long start)
+{
+    eTrackCallback(eventLoop, &eventLoop->stats.fileProc, start, fd, -1);
 }
 
 /* Process every pending time event, then every pending file event
@@ -145,6 +303,14 @@ static eTimeEvent *eSearchNearestTimer(eEventLoop *eventLoop)
  * if flags has AE_TIME_EVENTS set, time events are processed.
  * if flags has AE_DONT_WAIT set the function returns ASAP until all
  * the events that's possible to process without to wait are processed.
+ * if flags has E_CALL_BEFORE_SLEEP set the beforesleep callback is called
+ * right before polling.
+ * if flags has E_CALL_AFTER_SLEEP set the aftersleep callback is called
+ * right after polling, before any event handler.
+ *
+ * Every call is accounted in eventLoop->stats: the busy time of the
+ * iteration (poll wait excluded), the poll wait, every callback and the
+ * number of events processed.
  *
  * The function returns the number of events processed. */
 int eProcessEvents(eEventLoop *eventLoop, int flags)
@@ -152,45 +318,24 @@ int eProcessEvents(eEventLoop *eventLoop, int flags)
 	/* Nothing to do? return ASAP */
 	if (!(flags & E_TIME_EVENTS) && !(flags & E_FILE_EVENTS)) return 0;
 
-    int maxfd = 0, numfd = 0;
-    fd_set rfds, wfds, efds;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_ZERO(&efds);
-    /* Check file events */
-    if (flags & E_FILE_EVENTS) {
-    	eFileEvent *fe = eventLoop->fileEventHead;
-        while (fe != NULL) {
-            if (fe->mask & E_READABLE) FD_SET(fe->fd, &rfds);
-            if (fe->mask & E_WRITABLE) FD_SET(fe->fd, &wfds);
-            if (fe->mask & E_EXCEPTION) FD_SET(fe->fd, &efds);
-            if (maxfd < fe->fd) maxfd = fe->fd;
-            numfd++;
-            fe = fe->next;
-        }
-    }
-
     int processed = 0;
-    /* Note that we want call select() even if there are no file
+    long long start = eGetMonotonicNs(), pollwait = 0;
+    /* Note that we want call the poller even if there are no file
      * events to process as long as we want to process time events,
      * in order to sleep until the next time event is ready to fire. */
-    if (numfd || ((flags & E_TIME_EVENTS) && !(flags & E_DONT_WAIT))) {
+    if (((flags & E_FILE_EVENTS) && eventLoop->maxfd != -1) ||
+        ((flags & E_TIME_EVENTS) && !(flags & E_DONT_WAIT))) {
         eTimeEvent *shortest = NULL;
-        if ((flags & E_TIME_EVENTS) && !(flags & E_DONT_WAIT))
-            shortest = eSearchNearestTimer(eventLoop);
+        if ((flags & E_TIME_EVENTS) && !(flags & E_DONT_WAIT) && eventLoop->timeHeapLen)
+            shortest = eventLoop->timeHeap[0];
         struct timeval tv, *tvp;
         if (shortest) {
-            long now_sec, now_ms;
             /* Calculate the time missing for the nearest timer to fire. */
-            eGetTime(&now_sec, &now_ms);
+            long long ns = shortest->when - eGetMonotonicNs();
+            if (ns < 0) ns = 0;
             tvp = &tv;
-            tvp->tv_sec = shortest->when_sec - now_sec;
-            if (shortest->when_ms < now_ms) {
-                tvp->tv_usec = ((shortest->when_ms+1000) - now_ms) * 1000;
-                tvp->tv_sec--;
-            } else {
-                tvp->tv_usec = (shortest->when_ms - now_ms) * 1000;
-            }
+            tvp->tv_sec = ns / 1000000000;
+            tvp->tv_usec = (ns % 1000000000) / 1000;
         } else {
             /* If we have to check for events but need to return ASAP
              * because of E_DONT_WAIT we need to set the timeout to zero */
@@ -203,66 +348,109 @@ int eProcessEvents(eEventLoop *eventLoop, int flags)
             }
         }
 
-        int retval = select(maxfd+1, &rfds, &wfds, &efds, tvp);
-        if (retval > 0) {
-        	eFileEvent *fe = eventLoop->fileEventHead;
-            while (fe != NULL) {
-                int fd = (int) fe->fd;
-                if ((fe->mask & E_READABLE && FD_ISSET(fd, &rfds)) ||
-                    (fe->mask & E_WRITABLE && FD_ISSET(fd, &wfds)) ||
-                    (fe->mask & E_EXCEPTION && FD_ISSET(fd, &efds))) {
-                    int mask = 0;
-                    if (fe->mask & E_READABLE && FD_ISSET(fd, &rfds)) mask |= E_READABLE;
-                    if (fe->mask & E_WRITABLE && FD_ISSET(fd, &wfds)) mask |= E_WRITABLE;
-                    if (fe->mask & E_EXCEPTION && FD_ISSET(fd, &efds)) mask |= E_EXCEPTION;
-                    fe->fileProc(eventLoop, fe->fd, fe->clientData, mask);
-                    processed++;
-                    /* After an event is processed our file event list
-                     * may no longer be the same, so what we do
-                     * is to clear the bit for this file descriptor and
-                     * restart again from the head. */
-                    fe = eventLoop->fileEventHead;
-                    FD_CLR(fd, &rfds);
-                    FD_CLR(fd, &wfds);
-                    FD_CLR(fd, &efds);
-                } else {
-                    fe = fe->next;
+        if (eventLoop->beforesleep != NULL && flags & E_CALL_BEFORE_SLEEP)
+            eventLoop->beforesleep(eventLoop);
+
+        long long pollstart = eGetMonotonicNs();
+        int numevents = eApiPoll(eventLoop, tvp);
+        pollwait = eGetMonotonicNs() - pollstart;
+        latencyHistAdd(&eventLoop->stats.poll, pollwait / 1000);
+
+        if (eventLoop->aftersleep != NULL && flags & E_CALL_AFTER_SLEEP)
+            eventLoop->aftersleep(eventLoop);
+
+        /* The fired array is a snapshot of what the poller reported.
+         * Handlers may add or remove file events (even for other fds)
+         * while we walk it, so the slot mask is checked again before
+         * every single call. */
+        for (int j = 0; j < numevents; j++) {
+            int fd = eventLoop->fired[j].fd;
+            int mask = eventLoop->fired[j].mask;
+            eFileEvent *fe = &eventLoop->events[fd];
+            int rfired = 0;
+            if (fe->mask & mask & E_READABLE) {
+                long long cbstart = eGetMonotonicNs();
+                rfired = 1;
+                fe->rfileProc(eventLoop, fd, fe->clientData, E_READABLE);
+                eTrackCallback(eventLoop, &eventLoop->stats.fileProc, cbstart, fd, -1);
+            }
+            /* Refresh the slot pointer, the read handler may have grown
+             * the events array. Don't call the same handler twice. */
+            fe = &eventLoop->events[fd];
+            if (fe->mask & mask & E_WRITABLE) {
+                if (!rfired || fe->wfileProc != fe->rfileProc) {
+                    long long cbstart = eGetMonotonicNs();
+                    fe->wfileProc(eventLoop, fd, fe->clientData, E_WRITABLE);
+                    eTrackCallback(eventLoop, &eventLoop->stats.fileProc, cbstart, fd, -1);
                 }
             }
+            processed++;
         }
     }
     /* Check time events */
     if (flags & E_TIME_EVENTS) {
-    	eTimeEvent *te = eventLoop->timeEventHead;
-    	long long maxId = eventLoop->timeEventNextId - 1;
-        while (te) {
-            if (te->id > maxId) {
-                te = te->next;
-                continue;
-            }
-            long now_sec, now_ms;
-            eGetTime(&now_sec, &now_ms);
-            if (now_sec > te->when_sec || (now_sec == te->when_sec && now_ms >= te->when_ms)) {
-                long long id = te->id;
-                int retval = te->timeProc(eventLoop, id, te->clientData);
-                /* After an event is processed our time event list may
-                 * no longer be the same, so we restart from head.
-                 * Still we make sure to don't process events registered
-                 * by event handlers itself in order to don't loop forever.
-                 * To do so we saved the max ID we want to handle. */
-                if (retval == E_NOMORE) eDeleteTimeEvent(eventLoop, id);
-                else eAddMillisecondsToNow(retval, &te->when_sec, &te->when_ms);
-                te = eventLoop->timeEventHead;
+        /* Don't process events registered by event handlers itself in
+         * order to don't loop forever. To do so we saved the max ID we
+         * want to handle. */
+        long long maxId = eventLoop->timeEventNextId - 1;
+        long long now = eGetMonotonicNs();
+        while (eventLoop->timeHeapLen) {
+            eTimeEvent *te = eventLoop->timeHeap[0];
+            if (te->when > now || te->id > maxId) break;
+            long long id = te->id, cbstart = eGetMonotonicNs();
+            int retval = te->timeProc(eventLoop, id, te->clientData);
+            eTrackCallback(eventLoop, &eventLoop->stats.timeProc, cbstart, -1, id);
+            processed++;
+            /* The handler may have deleted its own timer. */
+            if ((te = eTimeLookup(eventLoop, id)) == NULL) continue;
+            if (retval == E_NOMORE) {
+                eDeleteTimeEvent(eventLoop, id);
             } else {
-                te = te->next;
+                te->when = eGetMonotonicNs() + (long long)retval*1000000;
+                eTimeHeapFix(eventLoop, te);
             }
         }
     }
+    latencyHistAdd(&eventLoop->stats.iteration, (eGetMonotonicNs() - start - pollwait) / 1000);
+    latencyHistAdd(&eventLoop->stats.events, processed);
     return processed; /* return the number of processed file/time events */
 }
 
 void eMain(eEventLoop *eventLoop)
 {
     eventLoop->stop = 0;
-    while (!eventLoop->stop) eProcessEvents(eventLoop, E_ALL_EVENTS);
+    while (!eventLoop->stop) eProcessEvents(eventLoop, E_ALL_EVENTS|E_CALL_BEFORE_SLEEP|E_CALL_AFTER_SLEEP);
+}
+
+char *eGetApiName(void)
+{
+    return eApiName();
+}
+
+void eSetBeforeSleepProc(eEventLoop *eventLoop, eBeforeSleepProc *beforesleep)
+{
+    eventLoop->beforesleep = beforesleep;
+}
+
+void eSetAfterSleepProc(eEventLoop *eventLoop, eBeforeSleepProc *aftersleep)
+{
+    eventLoop->aftersleep = aftersleep;
+}
+
+/* Call 'proc' for every callback running 'threshold' microseconds or
+ * more. A zero threshold disables stall detection. */
+void eSetStallProc(eEventLoop *eventLoop, long long threshold, eStallProc *proc)
+{
+    eventLoop->stallThreshold = threshold;
+    eventLoop->stallProc = proc;
+}
+
+void eResetStats(eEventLoop *eventLoop)
+{
+    latencyHistReset(&eventLoop->stats.iteration);
+    latencyHistReset(&eventLoop->stats.poll);
+    latencyHistReset(&eventLoop->stats.fileProc);
+    latencyHistReset(&eventLoop->stats.timeProc);
+    latencyHistReset(&eventLoop->stats.events);
+    eventLoop->stats.stalls = 0;
 }
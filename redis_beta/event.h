@@ -1,39 +1,74 @@
 #ifndef __EVENT_H__
 #define __EVENT_H__
 
+#include "latency.h"
+
 struct eEventLoop;
 
 /* Types and data structures */
 typedef void eFileProc(struct eEventLoop *eventLoop, int fd, void *clientData, int mask);
 typedef int eTimeProc(struct eEventLoop *eventLoop, long long id, void *clientData);
 typedef void eEventFinalizerProc(struct eEventLoop *eventLoop, void *clientData);
+typedef void eBeforeSleepProc(struct eEventLoop *eventLoop);
+typedef void eStallProc(struct eEventLoop *eventLoop, int fd, long long id, long long usec);
 
-/* File event structure */
+/* File event structure. There is one slot per file descriptor, indexed
+ * by the fd itself, so registering or removing a handler is O(1). The
+ * clientData and finalizer are shared by the read and write handlers, the
+ * finalizer is called when the last handler of the fd is removed. */
 typedef struct eFileEvent {
-    int fd;
-    int mask; /* one of E_(READABLE|WRITABLE|EXCEPTION) */
-    eFileProc *fileProc;
+    int mask; /* E_NONE or E_READABLE and/or E_WRITABLE */
+    eFileProc *rfileProc;
+    eFileProc *wfileProc;
     eEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct eFileEvent *next;
 } eFileEvent;
 
 /* Time event structure */
 typedef struct eTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* monotonic deadline, in nanoseconds */
+    int heapIndex; /* position in the timer heap */
     eTimeProc *timeProc;
     eEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct eTimeEvent *next;
+    struct eTimeEvent *idNext; /* next event in the same ID table bucket */
 } eTimeEvent;
 
+/* A fired event, as reported by the polling backend */
+typedef struct eFiredEvent {
+    int fd;
+    int mask;
+} eFiredEvent;
+
+/* Event loop statistics. Times are in microseconds. */
+typedef struct eLoopStats {
+    latencyHist iteration; /* busy time of a whole iteration, poll excluded */
+    latencyHist poll;      /* time spent waiting in the poller */
+    latencyHist fileProc;  /* a single file event callback */
+    latencyHist timeProc;  /* a single time event callback */
+    latencyHist events;    /* number of events processed per iteration */
+    unsigned long long stalls; /* callbacks over the stall threshold */
+} eLoopStats;
+
 /* State of an event based program */
 typedef struct eEventLoop {
+    int maxfd;   /* highest file descriptor currently registered, or -1 */
+    int setsize; /* max fd+1 the loop is currently able to track */
     long long timeEventNextId;
-    eFileEvent *fileEventHead;
-    eTimeEvent *timeEventHead;
+    eFileEvent *events; /* registered file events, indexed by fd */
+    eFiredEvent *fired; /* fired events, filled by the polling backend */
+    eTimeEvent **timeHeap; /* time events, min-heap ordered by deadline */
+    int timeHeapLen;
+    int timeHeapSize;
+    eTimeEvent **timeTable; /* time events by ID, for O(1) lookup */
+    unsigned long timeTableSize;
+    void *apidata; /* polling backend specific data */
+    eBeforeSleepProc *beforesleep; /* called before every poll, may be NULL */
+    eBeforeSleepProc *aftersleep;  /* called after every poll, may be NULL */
+    long long stallThreshold; /* usec, 0 means stall detection disabled */
+    eStallProc *stallProc;
+    eLoopStats stats;
     int stop;
 } eEventLoop;
 
@@ -41,17 +76,24 @@ typedef struct eEventLoop {
 #define E_OK 0
 #define E_ERR -1
 
+#define E_NONE 0
 #define E_READABLE 1
 #define E_WRITABLE 2
-#define E_EXCEPTION 4
 
 #define E_FILE_EVENTS 1
 #define E_TIME_EVENTS 2
 #define E_ALL_EVENTS (E_FILE_EVENTS|E_TIME_EVENTS)
 #define E_DONT_WAIT 4
+#define E_CALL_BEFORE_SLEEP 8
+#define E_CALL_AFTER_SLEEP 16
 
 #define E_NOMORE -1
 
+#define E_SETSIZE_INITIAL 1024
+
+/* Anti-warning macro... */
+#define E_NOTUSED(V) ((void) V)
+
 /* Prototypes */
 eEventLoop *eCreateEventLoop(void);
 void eDeleteEventLoop(eEventLoop *eventLoop);
@@ -63,5 +105,12 @@ long long eCreateTimeEvent(eEventLoop *eventLoop, long long milliseconds,
 int eDeleteTimeEvent(eEventLoop *eventLoop, long long id);
 int eProcessEvents(eEventLoop *eventLoop, int flags);
 void eMain(eEventLoop *eventLoop);
+char *eGetApiName(void);
+void eSetBeforeSleepProc(eEventLoop *eventLoop, eBeforeSleepProc *beforesleep);
+void eSetAfterSleepProc(eEventLoop *eventLoop, eBeforeSleepProc *aftersleep);
+void eSetStallProc(eEventLoop *eventLoop, long long threshold, eStallProc *proc);
+void eResetStats(eEventLoop *eventLoop);
+long long eGetMonotonicNs(void);
+void eTrackFileEvent(eEventLoop *eventLoop, int fd, long long start);
 
 #endif
@@ -0,0 +1,108 @@
+/* Linux epoll(2) based event loop backend. Registering, modifying and
+ * removing a descriptor is O(1) and a poll only costs time proportional
+ * to the number of ready descriptors, so there is no FD_SETSIZE limit.
+ *
+ * This file is included by event.c, it is not compiled on its own. */
+
+#include <sys/epoll.h>
+
+typedef struct eApiState {
+    int epfd;
+    struct epoll_event *events;
+} eApiState;
+
+static int eApiCreate(eEventLoop *eventLoop)
+{
+    eApiState *state = malloc(sizeof(eApiState));
+    if (!state) return -1;
+    state->events = malloc(sizeof(struct epoll_event)*eventLoop->setsize);
+    if (!state->events) {
+        free(state);
+        return -1;
+    }
+    state->epfd = epoll_create(1024); /* 1024 is just a hint for the kernel */
+    if (state->epfd == -1) {
+        free(state->events);
+        free(state);
+        return -1;
+    }
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int eApiResize(eEventLoop *eventLoop, int setsize)
+{
+    eApiState *state = eventLoop->apidata;
+    struct epoll_event *events = realloc(state->events, sizeof(struct epoll_event)*setsize);
+    if (!events) return -1;
+    state->events = events;
+    return 0;
+}
+
+static void eApiFree(eEventLoop *eventLoop)
+{
+    eApiState *state = eventLoop->apidata;
+    close(state->epfd);
+    free(state->events);
+    free(state);
+}
+
+static int eApiAddEvent(eEventLoop *eventLoop, int fd, int mask)
+{
+    eApiState *state = eventLoop->apidata;
+    struct epoll_event ee = {0}; /* avoid valgrind warning */
+    /* If the fd was already monitored for some event, we need a MOD
+     * operation. Otherwise we need an ADD operation. */
+    int op = eventLoop->events[fd].mask == E_NONE ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    mask |= eventLoop->events[fd].mask; /* Merge old events */
+    if (mask & E_READABLE) ee.events |= EPOLLIN;
+    if (mask & E_WRITABLE) ee.events |= EPOLLOUT;
+    ee.data.fd = fd;
+    if (epoll_ctl(state->epfd, op, fd, &ee) == -1) return -1;
+    return 0;
+}
+
+static void eApiDelEvent(eEventLoop *eventLoop, int fd, int delmask)
+{
+    eApiState *state = eventLoop->apidata;
+    struct epoll_event ee = {0}; /* avoid valgrind warning */
+    int mask = eventLoop->events[fd].mask & (~delmask);
+    if (mask & E_READABLE) ee.events |= EPOLLIN;
+    if (mask & E_WRITABLE) ee.events |= EPOLLOUT;
+    ee.data.fd = fd;
+    if (mask != 0) {
+        epoll_ctl(state->epfd, EPOLL_CTL_MOD, fd, &ee);
+    } else {
+        /* Note, Kernel < 2.6.9 requires a non null event pointer even for
+         * EPOLL_CTL_DEL. */
+        epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ee);
+    }
+}
+
+static int eApiPoll(eEventLoop *eventLoop, struct timeval *tvp)
+{
+    eApiState *state = eventLoop->apidata;
+    int timeout = tvp ? (tvp->tv_sec*1000 + (tvp->tv_usec + 999)/1000) : -1;
+    int retval = epoll_wait(state->epfd, state->events, eventLoop->setsize, timeout);
+    int numevents = 0;
+    if (retval > 0) {
+        numevents = retval;
+        for (int j = 0; j < numevents; j++) {
+            struct epoll_event *e = state->events+j;
+            int mask = 0;
+            if (e->events & EPOLLIN) mask |= E_READABLE;
+            if (e->events & EPOLLOUT) mask |= E_WRITABLE;
+            /* Errors and hangups are reported to whatever handler is
+             * installed, the following read() or write() will see them. */
+            if (e->events & (EPOLLERR|EPOLLHUP)) mask |= E_READABLE|E_WRITABLE;
+            eventLoop->fired[j].fd = e->data.fd;
+            eventLoop->fired[j].mask = mask;
+        }
+    }
+    return numevents;
+}
+
+static char *eApiName(void)
+{
+    return "epoll";
+}
@@ -0,0 +1,313 @@
+/* Linux io_uring based event loop backend, talking to the kernel with the
+ * raw system calls so there is no liburing dependency.
+ *
+ * Readiness is still reported the usual way, so the eFileProc contract
+ * does not change: every registered fd has a one-shot IORING_OP_POLL_ADD
+ * armed in the kernel. Registrations, removals and the re-arming of the
+ * polls that fired are not sent to the kernel one by one: they are queued
+ * and flushed as a single batch of SQEs by the same io_uring_enter() that
+ * waits for completions, so a loop iteration costs one system call no
+ * matter how many fds changed state. Multishot polls are not used since
+ * they are edge triggered, while our handlers expect level triggered
+ * events (i.e. readQueryFromClient() reads at most one buffer per call).
+ *
+ * Requires a kernel with IORING_FEAT_EXT_ARG (5.11 or newer).
+ *
+ * This file is included by event.c, it is not compiled on its own. */
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+
+#define E_URING_ENTRIES 1024
+#define E_URING_IGNORE ((__u64)-1) /* user_data of SQEs we don't care about */
+
+/* Per fd state, indexed by fd like eventLoop->events. */
+typedef struct eUringFd {
+    unsigned int gen; /* bumped at every arm, tags the poll user_data */
+    int armed;        /* mask of the poll currently armed in the kernel */
+    int queued;       /* already in the dirty list */
+    int fired;        /* 1 + index in eventLoop->fired while polling, or 0 */
+} eUringFd;
+
+typedef struct eApiState {
+    int ringfd;
+    /* Submission queue */
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    struct io_uring_sqe *sqes;
+    unsigned sqentries;
+    unsigned sqlocaltail; /* tail including SQEs not yet published */
+    unsigned pending; /* SQEs queued but not yet submitted */
+    /* Completion queue */
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    /* Mappings, needed to release them */
+    void *sqring, *cqring;
+    size_t sqringsz, cqringsz, sqessz;
+    /* fds whose armed poll may not match the registered mask */
+    eUringFd *fds;
+    int *dirty;
+    int dirtylen;
+} eApiState;
+
+static int eUringSetup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int eUringEnter(eApiState *state, unsigned toSubmit, unsigned minComplete,
+        unsigned flags, void *arg, size_t argsz)
+{
+    return (int) syscall(__NR_io_uring_enter, state->ringfd, toSubmit, minComplete,
+            flags, arg, argsz);
+}
+
+static void eUringUnmap(eApiState *state)
+{
+    if (state->sqes != MAP_FAILED) munmap(state->sqes, state->sqessz);
+    if (state->cqring != MAP_FAILED && state->cqring != state->sqring)
+        munmap(state->cqring, state->cqringsz);
+    if (state->sqring != MAP_FAILED) munmap(state->sqring, state->sqringsz);
+}
+
+static int eApiCreate(eEventLoop *eventLoop)
+{
+    eApiState *state = malloc(sizeof(eApiState));
+    if (!state) return -1;
+    memset(state, 0, sizeof(*state));
+    state->sqring = state->cqring = state->sqes = MAP_FAILED;
+    state->fds = calloc(eventLoop->setsize, sizeof(eUringFd));
+    state->dirty = malloc(sizeof(int)*eventLoop->setsize);
+    if (!state->fds || !state->dirty) goto err;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    state->ringfd = eUringSetup(E_URING_ENTRIES, &p);
+    if (state->ringfd == -1) goto err;
+    if (!(p.features & IORING_FEAT_EXT_ARG)) goto errclose;
+
+    state->sqringsz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cqringsz = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cqringsz > state->sqringsz) state->sqringsz = state->cqringsz;
+        state->cqringsz = state->sqringsz;
+    }
+    state->sqring = mmap(NULL, state->sqringsz, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQ_RING);
+    if (state->sqring == MAP_FAILED) goto errclose;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cqring = state->sqring;
+    } else {
+        state->cqring = mmap(NULL, state->cqringsz, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_CQ_RING);
+        if (state->cqring == MAP_FAILED) goto errclose;
+    }
+    state->sqessz = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL, state->sqessz, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, state->ringfd, IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) goto errclose;
+
+    char *sq = state->sqring, *cq = state->cqring;
+    state->sqhead = (unsigned *)(sq + p.sq_off.head);
+    state->sqtail = (unsigned *)(sq + p.sq_off.tail);
+    state->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    state->sqarray = (unsigned *)(sq + p.sq_off.array);
+    state->sqentries = p.sq_entries;
+    state->sqlocaltail = *state->sqtail;
+    state->cqhead = (unsigned *)(cq + p.cq_off.head);
+    state->cqtail = (unsigned *)(cq + p.cq_off.tail);
+    state->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    eventLoop->apidata = state;
+    return 0;
+
+errclose:
+    eUringUnmap(state);
+    close(state->ringfd);
+err:
+    free(state->fds);
+    free(state->dirty);
+    free(state);
+    return -1;
+}
+
+static int eApiResize(eEventLoop *eventLoop, int setsize)
+{
+    eApiState *state = eventLoop->apidata;
+    eUringFd *fds = realloc(state->fds, sizeof(eUringFd)*setsize);
+    if (!fds) return -1;
+    memset(fds+eventLoop->setsize, 0, sizeof(eUringFd)*(setsize-eventLoop->setsize));
+    state->fds = fds;
+    int *dirty = realloc(state->dirty, sizeof(int)*setsize);
+    if (!dirty) return -1;
+    state->dirty = dirty;
+    return 0;
+}
+
+static void eApiFree(eEventLoop *eventLoop)
+{
+    eApiState *state = eventLoop->apidata;
+    eUringUnmap(state);
+    close(state->ringfd);
+    free(state->fds);
+    free(state->dirty);
+    free(state);
+}
+
+/* Make the queued SQEs visible to the kernel and submit them, optionally
+ * waiting for completions. Returns what io_uring_enter() returns. */
+static int eUringSubmit(eApiState *state, unsigned minComplete, unsigned flags,
+        void *arg, size_t argsz)
+{
+    __atomic_store_n(state->sqtail, state->sqlocaltail, __ATOMIC_RELEASE);
+    int retval = eUringEnter(state, state->pending, minComplete, flags, arg, argsz);
+    state->pending = 0;
+    return retval;
+}
+
+/* Return a zeroed SQE, submitting what is queued if the ring is full. */
+static struct io_uring_sqe *eUringGetSqe(eApiState *state)
+{
+    unsigned tail = state->sqlocaltail;
+    if (tail - __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE) >= state->sqentries) {
+        eUringSubmit(state, 0, 0, NULL, 0);
+        if (tail - __atomic_load_n(state->sqhead, __ATOMIC_ACQUIRE) >= state->sqentries)
+            return NULL;
+    }
+    unsigned idx = tail & *state->sqmask;
+    struct io_uring_sqe *sqe = &state->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    state->sqarray[idx] = idx;
+    state->sqlocaltail = tail+1;
+    state->pending++;
+    return sqe;
+}
+
+static void eUringMarkDirty(eApiState *state, int fd)
+{
+    if (state->fds[fd].queued) return;
+    state->fds[fd].queued = 1;
+    state->dirty[state->dirtylen++] = fd;
+}
+
+/* Queue the cancellation of the poll armed for 'fd', if any. From now on
+ * completions of that poll are stale and will be ignored. */
+static void eUringDisarm(eApiState *state, int fd)
+{
+    eUringFd *uf = &state->fds[fd];
+    struct io_uring_sqe *sqe;
+    if (uf->armed && (sqe = eUringGetSqe(state)) != NULL) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = ((__u64)uf->gen << 32) | (unsigned)fd;
+        sqe->user_data = E_URING_IGNORE;
+    }
+    uf->armed = 0;
+    uf->gen++;
+}
+
+/* Queue the SQEs needed to make the armed poll of every dirty fd match
+ * its registered mask. A handler added and removed within the same
+ * iteration (e.g. the writable handler of a fast reply) costs nothing. */
+static void eUringFlushDirty(eEventLoop *eventLoop)
+{
+    eApiState *state = eventLoop->apidata;
+    for (int j = 0; j < state->dirtylen; j++) {
+        int fd = state->dirty[j];
+        eUringFd *uf = &state->fds[fd];
+        int want = eventLoop->events[fd].mask;
+        struct io_uring_sqe *sqe;
+        uf->queued = 0;
+        if (uf->armed == want) continue;
+        eUringDisarm(state, fd);
+        if (want == E_NONE || (sqe = eUringGetSqe(state)) == NULL) continue;
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        if (want & E_READABLE) sqe->poll32_events |= POLLIN;
+        if (want & E_WRITABLE) sqe->poll32_events |= POLLOUT;
+        sqe->user_data = ((__u64)uf->gen << 32) | (unsigned)fd;
+        uf->armed = want;
+    }
+    state->dirtylen = 0;
+}
+
+static int eApiAddEvent(eEventLoop *eventLoop, int fd, int mask)
+{
+    E_NOTUSED(mask);
+    eUringMarkDirty(eventLoop->apidata, fd);
+    return 0;
+}
+
+static void eApiDelEvent(eEventLoop *eventLoop, int fd, int delmask)
+{
+    /* When the last handler goes away the fd is usually about to be
+     * closed, and its number may be reused before the next flush. The
+     * armed poll pins the old file, so cancel it right now instead of
+     * comparing masks later. */
+    if ((eventLoop->events[fd].mask & ~delmask) == E_NONE)
+        eUringDisarm(eventLoop->apidata, fd);
+    else
+        eUringMarkDirty(eventLoop->apidata, fd);
+}
+
+static int eApiPoll(eEventLoop *eventLoop, struct timeval *tvp)
+{
+    eApiState *state = eventLoop->apidata;
+    eUringFlushDirty(eventLoop);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    unsigned wait = 1;
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        arg.ts = (__u64)(unsigned long)&ts;
+        if (tvp->tv_sec == 0 && tvp->tv_usec == 0) wait = 0;
+    }
+    if (*state->cqtail != *state->cqhead) wait = 0; /* already have some */
+    eUringSubmit(state, wait, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+    int numevents = 0;
+    unsigned head = *state->cqhead;
+    unsigned tail = __atomic_load_n(state->cqtail, __ATOMIC_ACQUIRE);
+    for (; head != tail && numevents < eventLoop->setsize; head++) {
+        struct io_uring_cqe *cqe = &state->cqes[head & *state->cqmask];
+        if (cqe->user_data == E_URING_IGNORE) continue;
+        int fd = (int)(cqe->user_data & 0xffffffff);
+        unsigned gen = (unsigned)(cqe->user_data >> 32);
+        if (fd >= eventLoop->setsize || gen != state->fds[fd].gen) continue;
+        /* One-shot poll: it is consumed, re-arm it with the next batch. */
+        eUringFd *uf = &state->fds[fd];
+        uf->armed = 0;
+        eUringMarkDirty(state, fd);
+        if (cqe->res == -ECANCELED) continue;
+
+        int mask = 0;
+        if (cqe->res < 0) {
+            /* Let the handlers hit the error with read() / write(). */
+            mask = eventLoop->events[fd].mask;
+        } else {
+            if (cqe->res & (POLLIN|POLLERR|POLLHUP)) mask |= E_READABLE;
+            if (cqe->res & (POLLOUT|POLLERR|POLLHUP)) mask |= E_WRITABLE;
+        }
+        if (uf->fired) {
+            eventLoop->fired[uf->fired-1].mask |= mask;
+        } else {
+            eventLoop->fired[numevents].fd = fd;
+            eventLoop->fired[numevents].mask = mask;
+            uf->fired = ++numevents;
+        }
+    }
+    __atomic_store_n(state->cqhead, head, __ATOMIC_RELEASE);
+    for (int j = 0; j < numevents; j++) state->fds[eventLoop->fired[j].fd].fired = 0;
+    return numevents;
+}
+
+static char *eApiName(void)
+{
+    return "io_uring";
+}
@@ -0,0 +1,83 @@
+/* Select()-based event loop backend. It is the portable fallback used
+ * when no better polling API is available: every poll costs O(maxfd)
+ * and only descriptors below FD_SETSIZE can be monitored.
+ *
+ * This file is included by event.c, it is not compiled on its own. */
+
+#include <sys/select.h>
+#include <string.h>
+
+typedef struct eApiState {
+    fd_set rfds, wfds;
+    /* We need to have a copy of the fd sets as it's not safe to reuse
+     * FD sets after select(). */
+    fd_set _rfds, _wfds;
+} eApiState;
+
+static int eApiCreate(eEventLoop *eventLoop)
+{
+    eApiState *state = malloc(sizeof(eApiState));
+    if (!state) return -1;
+    FD_ZERO(&state->rfds);
+    FD_ZERO(&state->wfds);
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int eApiResize(eEventLoop *eventLoop, int setsize)
+{
+    E_NOTUSED(eventLoop);
+    /* Just ensure we have enough room in the fd_set type. */
+    if (setsize > FD_SETSIZE) return -1;
+    return 0;
+}
+
+static void eApiFree(eEventLoop *eventLoop)
+{
+    free(eventLoop->apidata);
+}
+
+static int eApiAddEvent(eEventLoop *eventLoop, int fd, int mask)
+{
+    eApiState *state = eventLoop->apidata;
+    if (fd >= FD_SETSIZE) return -1;
+    if (mask & E_READABLE) FD_SET(fd, &state->rfds);
+    if (mask & E_WRITABLE) FD_SET(fd, &state->wfds);
+    return 0;
+}
+
+static void eApiDelEvent(eEventLoop *eventLoop, int fd, int mask)
+{
+    eApiState *state = eventLoop->apidata;
+    if (mask & E_READABLE) FD_CLR(fd, &state->rfds);
+    if (mask & E_WRITABLE) FD_CLR(fd, &state->wfds);
+}
+
+static int eApiPoll(eEventLoop *eventLoop, struct timeval *tvp)
+{
+    eApiState *state = eventLoop->apidata;
+    memcpy(&state->_rfds, &state->rfds, sizeof(fd_set));
+    memcpy(&state->_wfds, &state->wfds, sizeof(fd_set));
+
+    int numevents = 0;
+    int retval = select(eventLoop->maxfd+1, &state->_rfds, &state->_wfds, NULL, tvp);
+    if (retval > 0) {
+        for (int j = 0; j <= eventLoop->maxfd; j++) {
+            eFileEvent *fe = &eventLoop->events[j];
+            if (fe->mask == E_NONE) continue;
+            int mask = 0;
+            if (fe->mask & E_READABLE && FD_ISSET(j, &state->_rfds)) mask |= E_READABLE;
+            if (fe->mask & E_WRITABLE && FD_ISSET(j, &state->_wfds)) mask |= E_WRITABLE;
+            if (mask == 0) continue;
+            eventLoop->fired[numevents].fd = j;
+            eventLoop->fired[numevents].mask = mask;
+            numevents++;
+        }
+    }
+    return numevents;
+}
+
+static char *eApiName(void)
+{
+    return "select";
+}
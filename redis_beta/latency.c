@@ -0,0 +1,40 @@
+/* latency.c - Power of two histograms for event loop latencies
+ * This software is released under the GPL license version 2.0 */
+
+#include <string.h>
+#include "latency.h"
+
+void latencyHistReset(latencyHist *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void latencyHistAdd(latencyHist *h, long long value)
+{
+    if (value < 0) value = 0;
+    int j = value < 2 ? 0 : 63 - __builtin_clzll((unsigned long long)value);
+    if (j >= LATENCY_HIST_BUCKETS) j = LATENCY_HIST_BUCKETS-1;
+    h->buckets[j]++;
+    h->count++;
+    h->sum += value;
+    if ((unsigned long long)value > h->max) h->max = value;
+}
+
+/* Return an upper bound of the p-th percentile (0 < p <= 1), that is the
+ * highest value the bucket holding it can contain, capped to the max
+ * value seen. Returns 0 for an empty histogram. */
+unsigned long long latencyHistPercentile(latencyHist *h, double p)
+{
+    if (h->count == 0) return 0;
+    unsigned long long rank = (unsigned long long)(p * h->count);
+    if (rank == 0) rank = 1;
+    unsigned long long seen = 0;
+    for (int j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        seen += h->buckets[j];
+        if (seen >= rank) {
+            unsigned long long upper = (2ULL << j) - 1;
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,23 @@
+/* Power of two histograms, used to track event loop latencies.
+ *
+ * Bucket 0 counts the values 0 and 1, bucket j > 0 counts the values in
+ * [2^j, 2^(j+1)). Values are usually microseconds but any non negative
+ * quantity works (i.e. the number of events processed per iteration). */
+
+#ifndef __LATENCY_H
+#define __LATENCY_H
+
+#define LATENCY_HIST_BUCKETS 40
+
+typedef struct latencyHist {
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long buckets[LATENCY_HIST_BUCKETS];
+} latencyHist;
+
+void latencyHistReset(latencyHist *h);
+void latencyHistAdd(latencyHist *h, long long value);
+unsigned long long latencyHistPercentile(latencyHist *h, double p);
+
+#endif /* __LATENCY_H */
@@ -1,10 +1,16 @@
 /* anet.c -- Basic TCP socket stuff made a bit less boring
  * Copyright (C) 2006-2009 Salvatore Sanfilippo <antirez@invece.org> */
 
+#define _GNU_SOURCE /* accept4() */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -50,7 +56,79 @@ int netTcpNoDelay(char *err, int fd)
     return NET_OK;
 }
 
-int netTcpServer(char *err, int port, char *bindaddr)
+/* While corked the kernel only sends full segments, so a reply written
+ * with many calls leaves as few packets as possible once uncorked. */
+int netTcpCork(char *err, int fd, int on)
+{
+#if defined(TCP_CORK)
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == -1) {
+        netSetError(err, "setsockopt TCP_CORK: %s\n", strerror(errno));
+        return NET_ERR;
+    }
+#elif defined(TCP_NOPUSH)
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on)) == -1) {
+        netSetError(err, "setsockopt TCP_NOPUSH: %s\n", strerror(errno));
+        return NET_ERR;
+    }
+#else
+    (void) err; (void) fd; (void) on;
+#endif
+    return NET_OK;
+}
+
+/* Let send(MSG_ZEROCOPY) transmit from the user memory */
+int netZeroCopy(char *err, int fd)
+{
+#ifdef SO_ZEROCOPY
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1) {
+        netSetError(err, "setsockopt SO_ZEROCOPY: %s\n", strerror(errno));
+        return NET_ERR;
+    }
+    return NET_OK;
+#else
+    (void) fd;
+    netSetError(err, "SO_ZEROCOPY not supported\n");
+    return NET_ERR;
+#endif
+}
+
+/* Read the MSG_ZEROCOPY completions from the socket error queue. The
+ * sends are numbered from 0 and complete in order on TCP: given the
+ * number of sends 'done' so far, returns the updated number. */
+unsigned int netZeroCopyCompleted(int fd, unsigned int done)
+{
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+    char control[128];
+    while (1) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) == -1) break;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) continue;
+            struct sock_extended_err *serr = (void*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            if ((int)(serr->ee_data+1 - done) > 0) done = serr->ee_data+1;
+        }
+    }
+#else
+    (void) fd;
+#endif
+    return done;
+}
+
+/* Close a connection dropping the data not sent yet (RST) */
+void netAbort(int fd)
+{
+    struct linger l = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+    close(fd);
+}
+
+static int netTcpGenericServer(char *err, int port, char *bindaddr, int backlog, int reuseport)
 {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd == -1) {
@@ -64,6 +142,19 @@ int netTcpServer(char *err, int port, char *bindaddr)
         close(fd);
         return NET_ERR;
     }
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        netSetError(err, "setsockopt SO_REUSEPORT: %s\n", strerror(errno));
+        close(fd);
+        return NET_ERR;
+    }
+#else
+    if (reuseport) {
+        netSetError(err, "SO_REUSEPORT not supported\n");
+        close(fd);
+        return NET_ERR;
+    }
+#endif
 
     struct sockaddr_in sa;
     sa.sin_family = AF_INET;
@@ -76,7 +167,7 @@ int netTcpServer(char *err, int port, char *bindaddr)
         return NET_ERR;
     }
 
-    if (listen(fd, 5) == -1) {
+    if (listen(fd, backlog) == -1) {
         netSetError(err, "listen: %s\n", strerror(errno));
         close(fd);
         return NET_ERR;
@@ -84,24 +175,100 @@ int netTcpServer(char *err, int port, char *bindaddr)
     return fd;
 }
 
-int netAccept(char *err, int serversock, char *ip, int *port)
+int netTcpServer(char *err, int port, char *bindaddr, int backlog)
+{
+    return netTcpGenericServer(err, port, bindaddr, backlog, 0);
+}
+
+/* Like netTcpServer() but many sockets can listen on the same port, the
+ * kernel balances the incoming connections between them. */
+int netTcpServerReusePort(char *err, int port, char *bindaddr, int backlog)
+{
+    return netTcpGenericServer(err, port, bindaddr, backlog, 1);
+}
+
+/* Listen on a unix domain socket. If perm is not zero the socket file
+ * permissions are set to it. */
+int netUnixServer(char *err, char *path, mode_t perm, int backlog)
+{
+    struct sockaddr_un sa;
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        netSetError(err, "unix socket path too long\n");
+        return NET_ERR;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        netSetError(err, "socket: %s\n", strerror(errno));
+        return NET_ERR;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+        netSetError(err, "bind: %s\n", strerror(errno));
+        close(fd);
+        return NET_ERR;
+    }
+    if (perm && chmod(sa.sun_path, perm) == -1) {
+        netSetError(err, "chmod: %s\n", strerror(errno));
+        close(fd);
+        return NET_ERR;
+    }
+
+    if (listen(fd, backlog) == -1) {
+        netSetError(err, "listen: %s\n", strerror(errno));
+        close(fd);
+        return NET_ERR;
+    }
+    return fd;
+}
+
+/* The returned socket is non blocking and close on exec. On error errno
+ * is preserved, so the caller can check EAGAIN. */
+static int netGenericAccept(char *err, int serversock, struct sockaddr *sa, socklen_t *len)
 {
     int fd;
-    struct sockaddr_in sa;
     while (1) {
-    	unsigned int saLen = sizeof(sa);
-        fd = accept(serversock, (struct sockaddr *)&sa, &saLen);
+#ifdef SOCK_NONBLOCK
+        /* Set the flags with the same syscall */
+        fd = accept4(serversock, sa, len, SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+        fd = accept(serversock, sa, len);
+        if (fd != -1) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            netNonBlock(NULL, fd);
+        }
+#endif
         if (fd == -1) {
             if (errno == EINTR) {
                 continue;
             } else {
+                int saved = errno;
                 netSetError(err, "accept: %s\n", strerror(errno));
+                errno = saved;
                 return NET_ERR;
             }
         }
         break;
     }
+    return fd;
+}
+
+int netAccept(char *err, int serversock, char *ip, int *port)
+{
+    struct sockaddr_in sa;
+    socklen_t saLen = sizeof(sa);
+    int fd = netGenericAccept(err, serversock, (struct sockaddr *)&sa, &saLen);
+    if (fd == NET_ERR) return NET_ERR;
     if (ip) strcpy(ip, inet_ntoa(sa.sin_addr));
     if (port) *port = ntohs(sa.sin_port);
     return fd;
 }
+
+int netUnixAccept(char *err, int serversock)
+{
+    struct sockaddr_un sa;
+    socklen_t saLen = sizeof(sa);
+    return netGenericAccept(err, serversock, (struct sockaddr *)&sa, &saLen);
+}
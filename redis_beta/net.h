@@ -5,9 +5,18 @@
 #define NET_ERR -1
 #define NET_ERR_LEN 256
 
+#include <sys/types.h>
+
 int netNonBlock(char *err, int fd);
 int netTcpNoDelay(char *err, int fd);
-int netTcpServer(char *err, int port, char *bindaddr);
+int netTcpCork(char *err, int fd, int on);
+int netZeroCopy(char *err, int fd);
+unsigned int netZeroCopyCompleted(int fd, unsigned int done);
+void netAbort(int fd);
+int netTcpServer(char *err, int port, char *bindaddr, int backlog);
+int netTcpServerReusePort(char *err, int port, char *bindaddr, int backlog);
+int netUnixServer(char *err, char *path, mode_t perm, int backlog);
 int netAccept(char *err, int serversock, char *ip, int *port);
+int netUnixAccept(char *err, int serversock);
 
 #endif
@@ -33,43 +33,79 @@ static void llenCommand(redisClient *client);
 static void lindexCommand(redisClient *client);
 static void lrangeCommand(redisClient *client);
 static void ltrimCommand(redisClient *client);
+static void latencyCommand(redisClient *client);
+static void mgetCommand(redisClient *client);
+static void quitCommand(redisClient *client);
 
 /*=============================== Globals ============================ */
 /* Global vars */
-static struct redisServer server; /* server global state */
+static __thread struct redisServer server; /* server (shard) global state */
 static struct redisCommand cmdTable[] = {
-    {"get", getCommand, 2, REDIS_CMD_INLINE},
-    {"set", setCommand, 3, REDIS_CMD_BULK},
-    {"setnx", setnxCommand, 3, REDIS_CMD_BULK},
-    {"del", delCommand, 2, REDIS_CMD_INLINE},
-    {"exists", existsCommand, 2, REDIS_CMD_INLINE},
-    {"incr", incrCommand, 2, REDIS_CMD_INLINE},
-    {"decr", decrCommand, 2, REDIS_CMD_INLINE},
-    {"rpush", rpushCommand, 3, REDIS_CMD_BULK},
-    {"lpush", lpushCommand, 3, REDIS_CMD_BULK},
-    {"rpop", rpopCommand, 2, REDIS_CMD_INLINE},
-    {"lpop", lpopCommand, 2, REDIS_CMD_INLINE},
-    {"llen", llenCommand, 2, REDIS_CMD_INLINE},
-    {"lindex", lindexCommand, 3, REDIS_CMD_INLINE},
-    {"lrange", lrangeCommand, 4, REDIS_CMD_INLINE},
-    {"ltrim", ltrimCommand, 4, REDIS_CMD_INLINE},
-    {"randomkey", randomkeyCommand, 1, REDIS_CMD_INLINE},
-    {"select", selectCommand, 2, REDIS_CMD_INLINE},
-    {"move", moveCommand, 3, REDIS_CMD_INLINE},
-    {"rename", renameCommand, 3, REDIS_CMD_INLINE},
-    {"renamenx", renamenxCommand, 3, REDIS_CMD_INLINE},
-    {"keys", keysCommand, 2, REDIS_CMD_INLINE},
-    {"dbsize", dbsizeCommand, 1, REDIS_CMD_INLINE},
-    {"ping", pingCommand, 1, REDIS_CMD_INLINE},
-    {"echo", echoCommand, 2, REDIS_CMD_BULK},
-    {"save", saveCommand, 1, REDIS_CMD_INLINE},
-    {"bgsave", bgsaveCommand, 1, REDIS_CMD_INLINE},
-    {"shutdown", shutdownCommand, 1, REDIS_CMD_INLINE},
-    {"lastsave", lastsaveCommand, 1, REDIS_CMD_INLINE},
+    {"get", getCommand, 2, REDIS_CMD_INLINE, REDIS_CMD_READONLY, 1, 1, 1},
+    {"mget", mgetCommand, -2, REDIS_CMD_INLINE, REDIS_CMD_READONLY|REDIS_CMD_MULTIKEY, 1, -1, 1},
+    {"set", setCommand, 3, REDIS_CMD_BULK, REDIS_CMD_WRITE|REDIS_CMD_DENYOOM, 1, 1, 1},
+    {"setnx", setnxCommand, 3, REDIS_CMD_BULK, REDIS_CMD_WRITE|REDIS_CMD_DENYOOM, 1, 1, 1},
+    {"del", delCommand, 2, REDIS_CMD_INLINE, REDIS_CMD_WRITE, 1, 1, 1},
+    {"exists", existsCommand, 2, REDIS_CMD_INLINE, REDIS_CMD_READONLY, 1, 1, 1},
+    {"incr", incrCommand, 2, REDIS_CMD_INLINE, REDIS_CMD_WRITE|REDIS_CMD_DENYOOM, 1, 1, 1},
+    {"decr", decrCommand, 2, REDIS_CMD_INLINE, REDIS_CMD_WRITE|REDIS_CMD_DENYOOM, 1, 1, 1},
+    {"rpush", rpushCommand, 3, REDIS_CMD_BULK, REDIS_CMD_WRITE|REDIS_CMD_DENYOOM, 1, 1, 1},
+    {"lpush", lpushCommand, 3, REDIS_CMD_BULK, REDIS_CMD_WRITE|REDIS_CMD_DENYOOM, 1, 1, 1},
+    {"rpop", rpopCommand, 2, REDIS_CMD_INLINE, REDIS_CMD_WRITE, 1, 1, 1},
+    {"lpop", lpopCommand, 2, REDIS_CMD_INLINE, REDIS_CMD_WRITE, 1, 1, 1},
+    {"llen", llenCommand, 2, REDIS_CMD_INLINE, REDIS_CMD_READONLY, 1, 1, 1},
+    {"lindex", lindexCommand, 3, REDIS_CMD_INLINE, REDIS_CMD_READONLY, 1, 1, 1},
+    {"lrange", lrangeCommand, 4, REDIS_CMD_INLINE, REDIS_CMD_READONLY, 1, 1, 1},
+    {"ltrim", ltrimCommand, 4, REDIS_CMD_INLINE, REDIS_CMD_WRITE, 1, 1, 1},
+    {"randomkey", randomkeyCommand, 1, REDIS_CMD_INLINE, REDIS_CMD_READONLY|REDIS_CMD_MULTIKEY, 0, 0, 0},
+    {"select", selectCommand, 2, REDIS_CMD_INLINE, REDIS_CMD_NOKEY, 0, 0, 0},
+    {"move", moveCommand, 3, REDIS_CMD_INLINE, REDIS_CMD_WRITE, 1, 1, 1},
+    {"rename", renameCommand, 3, REDIS_CMD_INLINE, REDIS_CMD_WRITE|REDIS_CMD_MULTIKEY, 1, 2, 1},
+    {"renamenx", renamenxCommand, 3, REDIS_CMD_INLINE, REDIS_CMD_WRITE|REDIS_CMD_MULTIKEY, 1, 2, 1},
+    {"keys", keysCommand, 2, REDIS_CMD_INLINE, REDIS_CMD_READONLY|REDIS_CMD_MULTIKEY, 0, 0, 0},
+    {"dbsize", dbsizeCommand, 1, REDIS_CMD_INLINE, REDIS_CMD_READONLY|REDIS_CMD_MULTIKEY, 0, 0, 0},
+    {"ping", pingCommand, 1, REDIS_CMD_INLINE, REDIS_CMD_NOKEY, 0, 0, 0},
+    {"echo", echoCommand, 2, REDIS_CMD_BULK, REDIS_CMD_NOKEY, 0, 0, 0},
+    {"save", saveCommand, 1, REDIS_CMD_INLINE, REDIS_CMD_ADMIN, 0, 0, 0},
+    {"bgsave", bgsaveCommand, 1, REDIS_CMD_INLINE, REDIS_CMD_ADMIN, 0, 0, 0},
+    {"shutdown", shutdownCommand, 1, REDIS_CMD_INLINE, REDIS_CMD_ADMIN, 0, 0, 0},
+    {"lastsave", lastsaveCommand, 1, REDIS_CMD_INLINE, REDIS_CMD_ADMIN, 0, 0, 0},
+    {"latency", latencyCommand, 1, REDIS_CMD_INLINE, REDIS_CMD_NOKEY, 0, 0, 0},
+    {"quit", quitCommand, 1, REDIS_CMD_INLINE, REDIS_CMD_NOKEY, 0, 0, 0},
     /* lpop, rpop, lindex, llen */
     /* dirty, lastsave, info */
-    {"",NULL,0,0}
+    {"",NULL,0,0,0,0,0,0}
 };
+static dict *commands; /* cmdTable by name, see populateCommandTable() */
+
+/* Shard mode state shared by all the shard threads */
+static struct redisServer *shardServers[REDIS_SHARDS_MAX]; /* by shard id */
+static shardQueue **shardQueues;   /* from*shards+to */
+static struct redisServer shardConfig; /* configuration of the new shards */
+static pthread_barrier_t shardBarrier;
+static struct {
+    unsigned long ticket;       /* next ticket of a shard stopping the world */
+    unsigned long turn;         /* ticket of the shard stopping the world */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int parked;                 /* shards parked for the current stop */
+    unsigned long gen;          /* bumped when the world is resumed */
+} world = {0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+
+/* I/O threads state, shared by the main thread and the I/O threads. The
+ * main thread is number 0 and takes its share of every job, so there are
+ * io.threads-1 extra threads. */
+static struct {
+    int threads;
+    pthread_t *tids;
+    pthread_mutex_t mutex;
+    pthread_cond_t start, done;
+    unsigned long round;        /* bumped to start a job */
+    int pending;                /* threads still working on the job */
+    int op;                     /* REDIS_IO_READ or REDIS_IO_WRITE */
+    redisClient **jobs;         /* clients of the job */
+    int jobslen;
+} io;
 
 /* ========================= Random utility functions ====================== */
 /* Redis generally does not try to recover from out of memory conditions
@@ -85,6 +121,26 @@ static void oom(const char *msg)
     abort();
 }
 
+/* Write the decimal representation of 'value' in 'buf', null terminated,
+ * without the cost of snprintf(). Returns its length, or 0 if 'len'
+ * bytes are not enough. */
+static int ll2string(char *buf, size_t len, long long value)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long v = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (value < 0) *--p = '-';
+    size_t l = tmp + sizeof(tmp) - p;
+    if (l >= len) return 0;
+    memcpy(buf, p, l);
+    buf[l] = '\0';
+    return l;
+}
+
 /* ======================= Redis objects implementation ===================== */
 static void freeStringObject(redisObject *obj)
 {
@@ -146,6 +202,20 @@ static redisObject *createListObject(void)
     return createObject(REDIS_LIST, l);
 }
 
+/* Return a deep copy of a string or list object */
+static redisObject *dupObject(redisObject *obj)
+{
+    if (obj->type == REDIS_STRING)
+        return createObject(REDIS_STRING, sdsdup(obj->ptr));
+    assert(obj->type == REDIS_LIST);
+    redisObject *copy = createListObject();
+    for (listNode *node = listFirst((list*)obj->ptr); node; node = listNextNode(node)) {
+        redisObject *elem = dupObject(listNodeValue(node));
+        if (!listAddNodeTail((list*)copy->ptr, elem)) oom("listAddNodeTail");
+    }
+    return copy;
+}
+
 /*============================ Utility functions ========================= */
 /* Glob-style pattern matching. */
 int stringmatchlen(const char *pattern, int patternLen, const char *string, int stringLen, int nocase) {
@@ -309,6 +379,33 @@ dictType sdsDictType = {
     sdsDictValDestructor,       /* val destructor */
 };
 
+/*================================ Shard keys =============================== */
+/* In shard mode every shard thread owns the keys hashing to it. The dicts
+ * index their buckets with the low bits of the same hash, so the shard is
+ * picked with a multiplicative hash of the whole value. */
+static int keyShard(sds key)
+{
+    if (server.shards == 1) return 0;
+    unsigned int h = dictGenHashFunction((unsigned char*)key, sdslen(key)) * 2654435769U;
+    return ((unsigned long long)h * server.shards) >> 32;
+}
+
+/* Return the DB 'dictid' of the shard owning 'key'. Unless this is the
+ * owner the caller must have stopped the world, see stopWorld(). */
+static dict *keyDict(sds key, int dictid)
+{
+    return shardServers[keyShard(key)]->dict[dictid];
+}
+
+/* Number of keys of a DB, the world must be stopped in shard mode */
+static unsigned long dbSize(int dictid)
+{
+    unsigned long size = 0;
+    for (int s = 0; s < server.shards; s++)
+        size += dictGetHashTableUsed(shardServers[s]->dict[dictid]);
+    return size;
+}
+
 /*============================ DB saving/loading ============================ */
 /* Save the DB on disk. Return REDIS_ERR on error, REDIS_OK on success */
 static int saveDb(char *filename)
@@ -323,13 +420,7 @@ static int saveDb(char *filename)
     if (fwrite("REDIS0000", 9, 1, fp) == 0) goto error;
     dictIterator *di = NULL;
     for (int j = 0; j < server.dbnum; j++) {
-        dict *dict = server.dict[j];
-        if (dictGetHashTableUsed(dict) == 0) continue;
-        di = dictGetIterator(dict);
-        if (!di) {
-            fclose(fp);
-            return REDIS_ERR;
-        }
+        if (dbSize(j) == 0) continue;
 
         /* Write the SELECT DB opcode */
         uint8_t type = REDIS_SELECTDB;
@@ -337,40 +428,53 @@ static int saveDb(char *filename)
         if (fwrite(&type, 1, 1, fp) == 0) goto error;
         if (fwrite(&len, 4, 1, fp) == 0) goto error;
 
-        /* Iterate this DB writing every entry */
-        dictEntry *de;
-        while ((de = dictNext(di)) != NULL) {
-            sds key = dictGetEntryKey(de);
-            redisObject *obj = dictGetEntryVal(de);
-            type = obj->type;
-            len = htonl(sdslen(key));
-            if (fwrite(&type, 1, 1, fp) == 0) goto error;
-            if (fwrite(&len, 4, 1, fp) == 0) goto error;
-            if (fwrite(key, sdslen(key), 1, fp) == 0) goto error;
-            if (type == REDIS_STRING) {
-                /* Save a string value */
-                sds val = obj->ptr;
-                len = htonl(sdslen(val));
-                if (fwrite(&len, 4, 1, fp) == 0) goto error;
-                if (fwrite(val, sdslen(val), 1, fp) == 0) goto error;
-            } else if (type == REDIS_LIST) {
-                /* Save a list value */
-                list *list = obj->ptr;
-                listNode *node = list->head;
-                len = htonl(listLength(list));
+        /* In shard mode the keys of a DB are split among the shards, the
+         * caller stopped the world so all of them can be read here. */
+        for (int s = 0; s < server.shards; s++) {
+            dict *dict = shardServers[s]->dict[j];
+            if (dictGetHashTableUsed(dict) == 0) continue;
+            di = dictGetIterator(dict);
+            if (!di) {
+                fclose(fp);
+                return REDIS_ERR;
+            }
+
+            /* Iterate this DB writing every entry */
+            dictEntry *de;
+            while ((de = dictNext(di)) != NULL) {
+                sds key = dictGetEntryKey(de);
+                redisObject *obj = dictGetEntryVal(de);
+                type = obj->type;
+                len = htonl(sdslen(key));
+                if (fwrite(&type, 1, 1, fp) == 0) goto error;
                 if (fwrite(&len, 4, 1, fp) == 0) goto error;
-                while (node) {
-                    redisObject *elem = listNodeValue(node);
-                    len = htonl(sdslen(elem->ptr));
-                    if (fwrite(&len, 4, 1 ,fp) == 0) goto error;
-                    if (fwrite(elem->ptr, sdslen(elem->ptr), 1, fp) == 0) goto error;
-                    node = node->next;
+                if (fwrite(key, sdslen(key), 1, fp) == 0) goto error;
+                if (type == REDIS_STRING) {
+                    /* Save a string value */
+                    sds val = obj->ptr;
+                    len = htonl(sdslen(val));
+                    if (fwrite(&len, 4, 1, fp) == 0) goto error;
+                    if (fwrite(val, sdslen(val), 1, fp) == 0) goto error;
+                } else if (type == REDIS_LIST) {
+                    /* Save a list value */
+                    list *list = obj->ptr;
+                    listNode *node = list->head;
+                    len = htonl(listLength(list));
+                    if (fwrite(&len, 4, 1, fp) == 0) goto error;
+                    while (node) {
+                        redisObject *elem = listNodeValue(node);
+                        len = htonl(sdslen(elem->ptr));
+                        if (fwrite(&len, 4, 1 ,fp) == 0) goto error;
+                        if (fwrite(elem->ptr, sdslen(elem->ptr), 1, fp) == 0) goto error;
+                        node = node->next;
+                    }
+                } else {
+                    assert(0 != 0);
                 }
-            } else {
-                assert(0 != 0);
             }
+            dictReleaseIterator(di);
+            di = NULL;
         }
-        dictReleaseIterator(di);
     }
     /* EOF opcode */
     uint8_t type = REDIS_EOF;
@@ -385,7 +489,7 @@ static int saveDb(char *filename)
         return REDIS_ERR;
     }
     redisLog(REDIS_NOTICE, "DB saved on disk");
-    server.dirty = 0;
+    for (int s = 0; s < server.shards; s++) shardServers[s]->dirty = 0;
     server.lastsave = time(NULL);
     return REDIS_OK;
 
@@ -402,7 +506,10 @@ static int saveDbBackground(char *filename)
     pid_t childpid = fork();
     if (childpid == 0) {
         /* Child */
-        close(server.fd);
+        for (int s = 0; s < server.shards; s++) {
+            close(shardServers[s]->fd);
+            if (shardServers[s]->sofd != -1) close(shardServers[s]->sofd);
+        }
         if (saveDb(filename) == REDIS_OK) exit(0);
         else exit(1);
     } else {
@@ -427,7 +534,7 @@ static int loadDb(char *filename)
     }
     char vbuf[REDIS_LOADBUF_LEN];   /* malloc() when the element is small */
     char *key = NULL, *val = NULL;
-    dict *dict = server.dict[0];
+    int dictid = 0;
     while (1) {
         /* Read type. */
         uint8_t type;
@@ -443,7 +550,7 @@ static int loadDb(char *filename)
                 		"compiled to handle more than %d databases. Exiting\n", server.dbnum);
                 exit(1);
             }
-            dict = server.dict[dbid];
+            dictid = dbid;
             continue;
         }
         /* Read key */
@@ -498,8 +605,9 @@ static int loadDb(char *filename)
         } else {
             assert(0 != 0);
         }
-        /* Add the new object in the hash table */
-        int retval = dictAdd(dict, sdsnewlen(key, klen), obj);
+        /* Add the new object in the hash table (of the owner shard) */
+        sds k = sdsnewlen(key, klen);
+        int retval = dictAdd(keyDict(k, dictid), k, obj);
         if (retval == DICT_ERR) {
             redisLog(REDIS_WARNING, "Loading DB, duplicated key found! Unrecoverable error, exiting now.");
             exit(1);
@@ -541,50 +649,339 @@ static void initServerConfig()
 {
     server.dbnum = REDIS_DEFAULT_DBNUM;
     server.port = REDIS_SERVERPORT;
+    server.tcpbacklog = REDIS_TCP_BACKLOG;
+    server.unixsocket = NULL;
+    server.unixsocketperm = 0;
     server.verbosity = REDIS_DEBUG;
     server.maxidletime = REDIS_MAXIDLETIME;
     server.saveparams = NULL;
     server.saveparamslen = 0;
     server.logfile = NULL; /* NULL = log on standard output */
+    server.stallthreshold = REDIS_STALL_THRESHOLD;
+    server.hz = REDIS_DEFAULT_HZ;
+    server.cronbudget = REDIS_CRON_BUDGET;
+    server.iothreads = 1;
+    server.zerocopythreshold = 0;
+    server.querybuflimit = REDIS_QUERYBUF_LIMIT;
+    server.clientpoolsize = REDIS_CLIENT_POOL;
+    for (int j = 0; j < REDIS_CLIENT_CLASSES; j++) {
+        server.outputlimits[j].hard = REDIS_OUTPUT_HARD_LIMIT;
+        server.outputlimits[j].soft = REDIS_OUTPUT_SOFT_LIMIT;
+        server.outputlimits[j].softseconds = REDIS_OUTPUT_SOFT_SECONDS;
+    }
+    server.iojobs = NULL;
+    server.iojobslen = server.iojobssize = 0;
+    server.shards = 1;
+    server.shardid = 0;
     appendServerSaveParams(60*60, 1);  /* save after 1 hour and 1 change */
     appendServerSaveParams(300, 100);  /* save after 5 minutes and 100 changes */
     appendServerSaveParams(60, 10000); /* save after 1 minute and 10000 changes */
 }
 
+/* The argument strings are not freed but kept in the argv, to parse the
+ * arguments of the next commands in their memory: commands only reading
+ * the arguments cost no allocation. A command keeping an argument, as a
+ * key or a value, takes it setting its argv entry to NULL. */
 static void freeClientArgv(redisClient *c)
 {
-    for (int j = 0; j < c->argc; j++) sdsfree(c->argv[j]);
+    for (int j = 0; j < c->argc; j++) {
+        if (c->argv[j] && (j >= REDIS_SPARE_ARGS ||
+                           sdsAllocSize(c->argv[j]) > REDIS_SPARE_ARG_SIZE)) {
+            sdsfree(c->argv[j]);
+            c->argv[j] = NULL;
+        }
+    }
     c->argc = 0;
 }
 
+/* Free the argv, the spare strings included */
+static void freeClientArgvArray(redisClient *c)
+{
+    freeClientArgv(c);
+    for (int j = 0; j < c->argvlen; j++) sdsfree(c->argv[j]);
+    free(c->argv);
+    c->argv = NULL;
+    c->argvlen = 0;
+}
+
+/* Make room in the argv for 'count' more arguments */
+static void clientArgvReserve(redisClient *c, int count)
+{
+    if (c->argc + count <= c->argvlen) return;
+    int len = c->argvlen ? c->argvlen : 4;
+    while (len < c->argc + count) len *= 2;
+    sds *argv = realloc(c->argv, sizeof(sds)*len);
+    if (!argv) oom("clientArgvReserve");
+    memset(argv+c->argvlen, 0, sizeof(sds)*(len-c->argvlen));
+    c->argv = argv;
+    c->argvlen = len;
+}
+
+/* Append to the argv the 'len' bytes at 'p', copied in the spare string
+ * of the argv slot if any. */
+static void addArgument(redisClient *c, char *p, size_t len)
+{
+    clientArgvReserve(c, 1);
+    sds arg = c->argv[c->argc];
+    arg = arg ? sdscpylen(arg, p, len) : sdsnewlen(p, len);
+    if (!arg) oom("addArgument");
+    c->argv[c->argc++] = arg;
+}
+
+static void zeroCopyPinObject(zeroCopyState *zc, redisObject *obj);
+static int zeroCopyOrphan(zeroCopyState *zc);
+static int isZeroCopyReply(redisClient *client, redisObject *obj);
+
+/* Add the client to the server clients, and to the table of the clients
+ * by fd. The table grows with the highest fd seen. */
+static void linkClient(redisClient *client)
+{
+    if (client->fd >= server.clientsbyfdsize) {
+        int size = server.clientsbyfdsize ? server.clientsbyfdsize : 1024;
+        while (size <= client->fd) size *= 2;
+        redisClient **table = realloc(server.clientsbyfd, sizeof(redisClient*)*size);
+        if (!table) oom("linkClient");
+        memset(table+server.clientsbyfdsize, 0,
+               sizeof(redisClient*)*(size-server.clientsbyfdsize));
+        server.clientsbyfd = table;
+        server.clientsbyfdsize = size;
+    }
+    server.clientsbyfd[client->fd] = client;
+    if (!listAddNodeTail(server.clients, client)) oom("listAddNodeTail");
+    client->clientsnode = listLast(server.clients);
+    if (!listAddNodeTail(server.idleclients, client)) oom("listAddNodeTail");
+    client->idlenode = listLast(server.idleclients);
+}
+
+/* Record an interaction with the client. As the monotonic clock only goes
+ * forward keeping server.idleclients ordered just takes moving the client
+ * to its tail, at most once per second. */
+static void touchClient(redisClient *client)
+{
+    if (client->lastinteraction == server.monotime) return;
+    client->lastinteraction = server.monotime;
+    listUnlinkNode(server.idleclients, client->idlenode);
+    listLinkNodeTail(server.idleclients, client->idlenode);
+}
+
+static redisClient *lookupClientByFd(int fd)
+{
+    if (fd < 0 || fd >= server.clientsbyfdsize) return NULL;
+    return server.clientsbyfd[fd];
+}
+
+/* Clients are recycled to make connections cheap: a client from the
+ * pool keeps its query buffer, reply list and argv, emptied by
+ * releaseClient(). The caller initializes the rest. */
+static redisClient *allocClient(void)
+{
+    if (server.clientpoollen) {
+        server.clientpoolhits++;
+        return server.clientpool[--server.clientpoollen];
+    }
+    server.clientpoolmisses++;
+    redisClient *client = malloc(sizeof(struct redisClient));
+    if (!client) return NULL;
+    client->querybuf = sdsempty();
+    if ((client->reply = listCreate()) == NULL) oom("listCreate");
+    listSetFreeMethod(client->reply, decrRefCount);
+    client->argv = NULL;
+    client->argc = client->argvlen = 0;
+    return client;
+}
+
+/* Put a freed client in the pool, or free it if the pool is full. Big
+ * buffers are not kept. */
+static void releaseClient(redisClient *client)
+{
+    if (server.clientpoollen == server.clientpoolsize) {
+        sdsfree(client->querybuf);
+        listRelease(client->reply);
+        freeClientArgvArray(client);
+        free(client);
+        return;
+    }
+    if (sdsAllocSize(client->querybuf) > REDIS_POOL_QUERYBUF_MAX) {
+        sdsfree(client->querybuf);
+        client->querybuf = sdsempty();
+    } else {
+        sdsclear(client->querybuf);
+    }
+    listNode *node;
+    while ((node = listFirst(client->reply)) != NULL) listDelNode(client->reply, node);
+    freeClientArgv(client);
+    if (client->argvlen > REDIS_SPARE_ARGS) freeClientArgvArray(client);
+    server.clientpool[server.clientpoollen++] = client;
+}
+
 static void freeClient(redisClient *client)
 {
     eDeleteFileEvent(server.el, client->fd, E_READABLE);
     eDeleteFileEvent(server.el, client->fd, E_WRITABLE);
-    sdsfree(client->querybuf);
-    listRelease(client->reply);
-    freeClientArgv(client);
-    close(client->fd);
-    listNode *node = listSearchKey(server.clients, client);
-    assert(node != NULL);
-    listDelNode(server.clients, node);
-    free(client);
+    /* The kernel may be still reading a reply half sent with zero copy */
+    if (client->zc && client->sentlen && !client->bufpos) {
+        redisObject *obj = listNodeValue(listFirst(client->reply));
+        if (isZeroCopyReply(client, obj)) zeroCopyPinObject(client->zc, obj);
+    }
+    /* With zero copy sends in flight the socket is closed later */
+    if (!client->zc || !zeroCopyOrphan(client->zc)) close(client->fd);
+    /* Unlink the client, it may be in any list: no search, its nodes are
+     * known. A client failing creation is not linked yet. */
+    if (client->clientsnode) {
+        listDelNode(server.clients, client->clientsnode);
+        listDelNode(server.idleclients, client->idlenode);
+        server.clientsbyfd[client->fd] = NULL;
+    }
+    if (client->pendingwritenode)
+        listDelNode(server.clients_pending_write, client->pendingwritenode);
+    if (client->pendingreadnode)
+        listDelNode(server.clients_pending_read, client->pendingreadnode);
+    if (client->closenode)
+        listDelNode(server.clients_to_close, client->closenode);
+    /* The reply of a call in flight will be dropped */
+    if (client->shardcall) client->shardcall->client = NULL;
+    releaseClient(client);
+}
+
+/* Free a client from the next beforeSleep(). Used where the client can't
+ * be freed right away, i.e. in the middle of a command. */
+static void freeClientAsync(redisClient *client)
+{
+    if (client->flags & REDIS_CLOSE_ASAP) return;
+    client->flags |= REDIS_CLOSE_ASAP;
+    if (!listAddNodeTail(server.clients_to_close, client)) oom("listAddNodeTail");
+    client->closenode = listLast(server.clients_to_close);
+}
+
+static void freeClientsInAsyncFreeQueue(void)
+{
+    listNode *node;
+    while ((node = listFirst(server.clients_to_close)) != NULL) {
+        redisClient *client = listNodeValue(node);
+        listDelNode(server.clients_to_close, node);
+        client->closenode = NULL;
+        client->flags &= ~REDIS_CLOSE_ASAP;
+        freeClient(client);
+    }
+}
+
+/* Reading the clock on every request is not free, so the server time is
+ * cached once per event loop iteration and in serverCron. Hot paths read
+ * server.unixtime / server.mstime instead of calling time(). Idle times
+ * use server.monotime, so they don't jump when the wall clock is set. */
+static void updateCachedTime(void)
+{
+    struct timeval tv;
+    struct timespec ts;
+    gettimeofday(&tv, NULL);
+    server.unixtime = tv.tv_sec;
+    server.mstime = (long long)tv.tv_sec*1000 + tv.tv_usec/1000;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    server.monotime = ts.tv_sec;
+}
+
+static long long ustime(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+/* The cron jobs below do a bounded amount of work per call, resuming
+ * where the previous call stopped: they return 1 if there is work left,
+ * so that serverCron runs again sooner. */
+
+/* If the percentage of used slots in the HT reaches REDIS_HT_MINFILL
+ * we resize the hash table to save memory. One DB after the other, as
+ * long as the time budget allows. */
+static int resizeDbsCron(long long budget)
+{
+    long long start = ustime();
+    for (int j = 0; j < server.dbnum; j++) {
+        int id = server.cronresizedb;
+        server.cronresizedb = (server.cronresizedb+1) % server.dbnum;
+        int size = dictGetHashTableSize(server.dict[id]);
+        int used = dictGetHashTableUsed(server.dict[id]);
+        if (size && used && (size > REDIS_HT_MINSLOTS) && (used*100/size < REDIS_HT_MINFILL)) {
+            redisLog(REDIS_NOTICE, "The hash table %d is too sparse, resize it...", id);
+            dictResize(server.dict[id]);
+            redisLog(REDIS_NOTICE, "Hash table %d resized.", id);
+            if (ustime()-start > budget) return j != server.dbnum-1;
+        }
+    }
+    return 0;
+}
+
+static int clientOverOutputLimits(redisClient *client);
+
+/* Release the query buffer space a client doesn't need anymore: after a
+ * big argument, or when the client is idle. */
+static void clientsCronResizeQueryBuffer(redisClient *c)
+{
+    size_t size = sdsAllocSize(c->querybuf);
+    time_t idle = server.monotime - c->lastinteraction;
+    if (size > REDIS_BIG_ARG && c->bulklen < REDIS_BIG_ARG &&
+        (c->querybufpeak < size/2 || idle > REDIS_QUERYBUF_IDLE))
+        c->querybuf = sdsRemoveFreeSpace(c->querybuf);
+    c->querybufpeak = 0;
 }
 
-static void closeTimedoutClients(void)
+/* Close the clients idle for more than maxidletime. The idle list is
+ * ordered by last interaction, so only the clients expiring are visited. */
+static int closeIdleClients(long long budget)
 {
-    listIter *it = listGetIterator(server.clients, DL_START_HEAD);
-    if (!it) return;
+    long long start = ustime();
     listNode *node;
-    while ((node = listNextElement(it)) != NULL) {
-    	redisClient *c = listNodeValue(node);
-    	time_t now = time(NULL);
-        if (now - c->lastinteraction > server.maxidletime) {
-            redisLog(REDIS_DEBUG, "Closing idle client");
+    while ((node = listFirst(server.idleclients)) != NULL) {
+        redisClient *c = listNodeValue(node);
+        if (server.monotime - c->lastinteraction <= server.maxidletime) return 0;
+        redisLog(REDIS_DEBUG, "Closing idle client");
+        freeClient(c);
+        if (ustime()-start > budget) return 1;
+    }
+    return 0;
+}
+
+/* Check a slice of the clients for staying too long over the soft output
+ * limit, and trim their query buffers. The clients list is rotated, so
+ * every client is checked about once per second. */
+static int clientsCron(long long budget)
+{
+    int numclients = listLength(server.clients);
+    int iterations = numclients/server.hz;
+    if (iterations < REDIS_CLIENTS_CRON_MIN_ITERATIONS) {
+        iterations = (numclients < REDIS_CLIENTS_CRON_MIN_ITERATIONS) ?
+                     numclients : REDIS_CLIENTS_CRON_MIN_ITERATIONS;
+    }
+    long long start = ustime();
+    while (listLength(server.clients) && iterations--) {
+        listRotate(server.clients);
+    	redisClient *c = listNodeValue(listFirst(server.clients));
+        if (clientOverOutputLimits(c)) {
             freeClient(c);
+        } else {
+            clientsCronResizeQueryBuffer(c);
         }
+        if (ustime()-start > budget) return iterations > 0;
+    }
+    return 0;
+}
+
+static void stopWorld(void);
+static void resumeWorld(void);
+static long long shardsDirty(void);
+static void initShard(void);
+static void zeroCopyOrphansCron(void);
+
+/* serverCron period in milliseconds, shorter if some job has work left */
+static int cronPeriod(int pending)
+{
+    int hz = server.hz;
+    if (pending) {
+        hz *= REDIS_CRON_BUSY_SPEEDUP;
+        if (hz > REDIS_MAX_HZ) hz = REDIS_MAX_HZ;
     }
-    listReleaseIterator(it);
+    return 1000/hz;
 }
 
 static int serverCron(struct eEventLoop *eventLoop, long long id, void *clientData)
@@ -593,25 +990,32 @@ static int serverCron(struct eEventLoop *eventLoop, long long id, void *clientDa
     REDIS_NOTUSED(id);
     REDIS_NOTUSED(clientData);
 
-    int loops = server.cronloops++;
-    /* If the percentage of used slots in the HT reaches REDIS_HT_MINFILL
-     * we resize the hash table to save memory */
-    for (int j = 0; j < server.dbnum; j++) {
-        int size = dictGetHashTableSize(server.dict[j]);
-        int used = dictGetHashTableUsed(server.dict[j]);
-        if (!(loops % 5) && used > 0) redisLog(REDIS_DEBUG, "DB %d: %d keys in %d slots HT.", j, used, size);
-        if (size && used && (size > REDIS_HT_MINSLOTS) && (used*100/size < REDIS_HT_MINFILL)) {
-            redisLog(REDIS_NOTICE, "The hash table %d is too sparse, resize it...", j);
-            dictResize(server.dict[j]);
-            redisLog(REDIS_NOTICE, "Hash table %d resized.", j);
+    server.cronloops++;
+    updateCachedTime();
+    int pending = 0;
+
+    /* Show information about the DBs and the connected clients */
+    if (server.mstime - server.cronlastlog >= 5000) {
+        server.cronlastlog = server.mstime;
+        for (int j = 0; j < server.dbnum; j++) {
+            int size = dictGetHashTableSize(server.dict[j]);
+            int used = dictGetHashTableUsed(server.dict[j]);
+            if (used > 0) redisLog(REDIS_DEBUG, "DB %d: %d keys in %d slots HT.", j, used, size);
         }
+        redisLog(REDIS_DEBUG, "%d clients connected (%d pooled)", listLength(server.clients),
+            server.clientpoollen);
     }
 
-    /* Show information about connected clients */
-    if (!(loops % 5)) redisLog(REDIS_DEBUG, "%d clients connected", listLength(server.clients));
+    pending |= resizeDbsCron(server.cronbudget);
 
     /* Close connections of timeout clients */
-    if (!(loops % 10)) closeTimedoutClients();
+    pending |= closeIdleClients(server.cronbudget);
+    pending |= clientsCron(server.cronbudget);
+
+    if (listLength(server.zcorphans)) zeroCopyOrphansCron();
+
+    /* The save state lives in the first shard */
+    if (server.shardid != 0) return cronPeriod(pending);
 
     /* Check if a background saving in progress terminated */
     if (server.bgsaveinprogress) {
@@ -620,8 +1024,10 @@ static int serverCron(struct eEventLoop *eventLoop, long long id, void *clientDa
             int exitcode = WEXITSTATUS(status);
             if (exitcode == 0) {
                 redisLog(REDIS_NOTICE, "Background saving terminated with success");
-                server.dirty = 0;
-                server.lastsave = time(NULL);
+                stopWorld();
+                for (int s = 0; s < server.shards; s++) shardServers[s]->dirty = 0;
+                resumeWorld();
+                server.lastsave = server.unixtime;
             } else {
                 redisLog(REDIS_WARNING, "Background saving error");
             }
@@ -629,17 +1035,22 @@ static int serverCron(struct eEventLoop *eventLoop, long long id, void *clientDa
         }
     } else {
         /* If there is not a background saving in progress check if we have to save now */
-         time_t now = time(NULL);
+         time_t now = server.unixtime;
+         long long dirty = shardsDirty();
          for (int j = 0; j < server.saveparamslen; j++) {
             struct saveParam *sp = server.saveparams + j;
-            if (server.dirty >= sp->changes && now-server.lastsave > sp->seconds) {
+            if (dirty >= sp->changes && now-server.lastsave > sp->seconds) {
                 redisLog(REDIS_NOTICE, "%d changes in %d seconds. Saving...", sp->changes, sp->seconds);
+                stopWorld();
                 saveDbBackground("dump.rdb");
+                resumeWorld();
                 break;
             }
          }
     }
-    return 1000;
+    /* Reap the background saving child as soon as it exits */
+    pending |= server.bgsaveinprogress;
+    return cronPeriod(pending);
 }
 
 static void createSharedObjects(void)
@@ -649,8 +1060,13 @@ static void createSharedObjects(void)
     sharedObjs.err = createObject(REDIS_STRING, sdsnew("-ERR\r\n"));
     sharedObjs.zerobulk = createObject(REDIS_STRING, sdsnew("0\r\n\r\n"));
     sharedObjs.nil = createObject(REDIS_STRING, sdsnew("nil\r\n"));
-    sharedObjs.zero = createObject(REDIS_STRING, sdsnew("0\r\n"));
-    sharedObjs.one = createObject(REDIS_STRING, sdsnew("1\r\n"));
+    for (int j = 0; j < REDIS_SHARED_INTEGERS; j++) {
+        char buf[32];
+        int len = ll2string(buf, sizeof(buf), j);
+        sharedObjs.integers[j] = createObject(REDIS_STRING, sdscatlen(sdsnewlen(buf, len), "\r\n", 2));
+    }
+    sharedObjs.zero = sharedObjs.integers[0];
+    sharedObjs.one = sharedObjs.integers[1];
     sharedObjs.pong = createObject(REDIS_STRING, sdsnew("+PONG\r\n"));
 }
 
@@ -660,29 +1076,86 @@ static void initServer()
     signal(SIGPIPE, SIG_IGN);
 
     server.clients = listCreate();
+    server.idleclients = listCreate();
+    server.clientsbyfd = NULL;
+    server.clientsbyfdsize = 0;
+    server.clientpool = malloc(sizeof(redisClient*)*(server.clientpoolsize+1)); /* never 0 */
+    server.clientpoollen = 0;
+    server.clientpoolhits = server.clientpoolmisses = 0;
+    server.clients_pending_write = listCreate();
+    server.clients_pending_read = listCreate();
     server.objfreelist = listCreate();
+    server.zcorphans = listCreate();
+    server.clients_to_close = listCreate();
     createSharedObjects();
     server.el = eCreateEventLoop();
+    if (!server.el) {
+        /* Not only OOM: i.e. io_uring may be disabled in this kernel */
+        redisLog(REDIS_WARNING, "Can't create the %s event loop: %s", eGetApiName(), strerror(errno));
+        exit(1);
+    }
     server.dict = malloc(sizeof(dict *) * server.dbnum);
-    if (!server.dict || !server.clients || !server.el || !server.objfreelist) oom("server initialization"); /* Fatal OOM */
+    if (!server.dict || !server.clients || !server.idleclients || !server.clientpool ||
+        !server.clients_pending_write || !server.clients_pending_read ||
+        !server.objfreelist || !server.zcorphans || !server.clients_to_close)
+        oom("server initialization"); /* Fatal OOM */
     for (int j = 0; j < server.dbnum; j++) {
         server.dict[j] = dictCreate(&sdsDictType, NULL);
         if (!server.dict[j]) oom("server initialization"); /* Fatal OOM */
     }
-    server.fd = netTcpServer(server.neterr, server.port, NULL);
+    if (server.shards > 1)
+        server.fd = netTcpServerReusePort(server.neterr, server.port, NULL, server.tcpbacklog);
+    else
+        server.fd = netTcpServer(server.neterr, server.port, NULL, server.tcpbacklog);
     if (server.fd == -1) {
         redisLog(REDIS_WARNING, "Opening TCP port: %s", server.neterr);
         exit(1);
     }
+    netNonBlock(NULL, server.fd); /* acceptHandler() accepts until EAGAIN */
+    /* A unix socket can't be shared, shard 0 accepts all the local clients */
+    server.sofd = -1;
+    if (server.unixsocket && server.shardid == 0) {
+        unlink(server.unixsocket); /* left by a previous instance */
+        server.sofd = netUnixServer(server.neterr, server.unixsocket,
+            server.unixsocketperm, server.tcpbacklog);
+        if (server.sofd == -1) {
+            redisLog(REDIS_WARNING, "Opening unix socket: %s", server.neterr);
+            exit(1);
+        }
+        netNonBlock(NULL, server.sofd);
+    }
+    latencyHistReset(&server.acceptburst);
+    latencyHistReset(&server.accepttime);
+    shardServers[server.shardid] = &server;
+    if (server.shards > 1) initShard();
     server.cronloops = 0;
     server.bgsaveinprogress = 0;
-    server.lastsave = time(NULL);
+    updateCachedTime();
+    server.lastsave = server.unixtime;
     server.dirty = 0;
-    eCreateTimeEvent(server.el, 1000, serverCron, NULL, NULL);
+    server.currentcmd = NULL;
+    server.cronresizedb = 0;
+    server.cronlastlog = 0;
+    server.cronid = eCreateTimeEvent(server.el, cronPeriod(0), serverCron, NULL, NULL);
 }
 
 /* I agree, this is a very rudimental way to load a configuration...
    will improve later if the config gets more complex */
+/* Convert a memory amount like "100", "1k", "64mb" in bytes. Returns -1
+ * if the string is not valid. */
+static long long memToBytes(char *p)
+{
+    char *u;
+    long long val = strtoll(p, &u, 10);
+    long long mul = 1;
+    if (u == p || val < 0) return -1;
+    if (!strcasecmp(u, "k") || !strcasecmp(u, "kb")) mul = 1024;
+    else if (!strcasecmp(u, "m") || !strcasecmp(u, "mb")) mul = 1024*1024;
+    else if (!strcasecmp(u, "g") || !strcasecmp(u, "gb")) mul = 1024LL*1024*1024;
+    else if (*u != '\0') return -1;
+    return val*mul;
+}
+
 static void loadServerConfig(char *filename)
 {
     FILE *fp = fopen(filename, "r");
@@ -712,6 +1185,12 @@ static void loadServerConfig(char *filename)
             	err = "Invalid timeout value";
             	goto loaderr;
             }
+        } else if (!strcmp(argv[0], "port") && argc == 2) {
+            server.port = atoi(argv[1]);
+            if (server.port < 1 || server.port > 65535) {
+                err = "Invalid port";
+                goto loaderr;
+            }
         } else if (!strcmp(argv[0], "save") && argc == 3) {
             int seconds = atoi(argv[1]);
             int changes = atoi(argv[2]);
@@ -746,6 +1225,86 @@ static void loadServerConfig(char *filename)
                 }
                 fclose(fp);
             }
+        } else if (!strcmp(argv[0], "stallthreshold") && argc == 2) {
+            server.stallthreshold = atoi(argv[1]);
+            if (server.stallthreshold < 0) {
+                err = "Invalid stall threshold";
+                goto loaderr;
+            }
+        } else if (!strcmp(argv[0], "iothreads") && argc == 2) {
+            server.iothreads = atoi(argv[1]);
+            if (server.iothreads < 1 || server.iothreads > REDIS_IOTHREADS_MAX) {
+                err = "Invalid number of I/O threads";
+                goto loaderr;
+            }
+        } else if (!strcmp(argv[0], "shards") && argc == 2) {
+            server.shards = atoi(argv[1]);
+            if (server.shards < 1 || server.shards > REDIS_SHARDS_MAX) {
+                err = "Invalid number of shards";
+                goto loaderr;
+            }
+        } else if (!strcmp(argv[0], "tcpbacklog") && argc == 2) {
+            server.tcpbacklog = atoi(argv[1]);
+            if (server.tcpbacklog < 1) {
+                err = "Invalid TCP backlog";
+                goto loaderr;
+            }
+        } else if (!strcmp(argv[0], "unixsocket") && argc == 2) {
+            server.unixsocket = strdup(argv[1]);
+        } else if (!strcmp(argv[0], "unixsocketperm") && argc == 2) {
+            char *eptr;
+            server.unixsocketperm = (mode_t)strtol(argv[1], &eptr, 8);
+            if (*eptr != '\0' || server.unixsocketperm > 0777) {
+                err = "Invalid socket file permissions";
+                goto loaderr;
+            }
+        } else if (!strcmp(argv[0], "zerocopythreshold") && argc == 2) {
+            server.zerocopythreshold = atoll(argv[1]);
+            if (server.zerocopythreshold < 0) {
+                err = "Invalid zero copy threshold";
+                goto loaderr;
+            }
+        } else if (!strcmp(argv[0], "outputlimit") && argc == 5) {
+            int class;
+            if (!strcmp(argv[1], "tcp")) class = REDIS_CLIENT_TCP;
+            else if (!strcmp(argv[1], "unix")) class = REDIS_CLIENT_UNIX;
+            else {
+                err = "Invalid client class, must be tcp or unix";
+                goto loaderr;
+            }
+            long long hard = memToBytes(argv[2]), soft = memToBytes(argv[3]);
+            int seconds = atoi(argv[4]);
+            if (hard == -1 || soft == -1 || seconds < 0) {
+                err = "Invalid output buffer limits";
+                goto loaderr;
+            }
+            server.outputlimits[class].hard = hard;
+            server.outputlimits[class].soft = soft;
+            server.outputlimits[class].softseconds = seconds;
+        } else if (!strcmp(argv[0], "querybuflimit") && argc == 2) {
+            server.querybuflimit = memToBytes(argv[1]);
+            if (server.querybuflimit < 1024) {
+                err = "Invalid query buffer limit";
+                goto loaderr;
+            }
+        } else if (!strcmp(argv[0], "clientpool") && argc == 2) {
+            server.clientpoolsize = atoi(argv[1]);
+            if (server.clientpoolsize < 0) {
+                err = "Invalid client pool size";
+                goto loaderr;
+            }
+        } else if (!strcmp(argv[0], "hz") && argc == 2) {
+            server.hz = atoi(argv[1]);
+            if (server.hz < 1 || server.hz > REDIS_MAX_HZ) {
+                err = "Invalid hz value";
+                goto loaderr;
+            }
+        } else if (!strcmp(argv[0], "cronbudget") && argc == 2) {
+            server.cronbudget = atoll(argv[1]);
+            if (server.cronbudget < 1) {
+                err = "Invalid cron budget";
+                goto loaderr;
+            }
         } else if (!strcmp(argv[0], "databases") && argc == 2) {
             server.dbnum = atoi(argv[1]);
             if (server.dbnum < 1) {
@@ -773,261 +1332,1061 @@ static int selectDb(redisClient *client, int id)
 {
     if (id < 0 || id >= server.dbnum) return REDIS_ERR;
     client->dict = server.dict[id];
+    client->dictid = id;
     return REDIS_OK;
 }
 
-static struct redisCommand *lookupCommand(char *name)
+/* Commands are looked up by name in a dict, case insensitive. It is only
+ * read after populateCommandTable(), so the shards share it. */
+static unsigned int commandDictHashFunction(const void *key)
 {
-    int j = 0;
-    while (cmdTable[j].name != NULL) {
-        if (!strcmp(name, cmdTable[j].name)) return &cmdTable[j];
-        j++;
-    }
-    return NULL;
+    return dictGenCaseHashFunction(key, sdslen((sds)key));
 }
 
-static void sendReplyToClient(eEventLoop *el, int fd, void *privdata, int mask)
+static int commandDictKeyCompare(void *privdata, const void *key1, const void *key2)
 {
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(mask);
-    int nwritten = 0, totwritten = 0;
-    redisClient *client = privdata;
-    while (listLength(client->reply)) {
-    	redisObject *obj = listNodeValue(listFirst(client->reply));
-        int objlen = sdslen(obj->ptr);
-        if (objlen == 0) {
-            listDelNode(client->reply, listFirst(client->reply));
-            continue;
-        }
-        nwritten = write(fd, obj->ptr + client->sentlen, objlen - client->sentlen);
-        if (nwritten <= 0) break;
-        client->sentlen += nwritten;
-        totwritten += nwritten;
-        /* If we fully sent the object on head go to the next one */
-        if (client->sentlen == objlen) {
-            listDelNode(client->reply, listFirst(client->reply));
-            client->sentlen = 0;
-        }
-    }
-    if (nwritten == -1) {
-        if (errno == EAGAIN) {
-            nwritten = 0;
-        } else {
-            redisLog(REDIS_DEBUG, "Error writing to client: %s", strerror(errno));
-            freeClient(client);
-            return;
-        }
-    }
-    if (totwritten > 0) client->lastinteraction = time(NULL);
-    if (listLength(client->reply) == 0) {
-        client->sentlen = 0;
-        eDeleteFileEvent(server.el, client->fd, E_WRITABLE);
+    DICT_NOTUSED(privdata);
+    size_t l1 = sdslen((sds)key1);
+    size_t l2 = sdslen((sds)key2);
+    if (l1 != l2) return 0;
+    return strncasecmp(key1, key2, l1) == 0;
+}
+
+static dictType commandDictType = {
+    commandDictHashFunction,   /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    commandDictKeyCompare,     /* key compare */
+    sdsDictKeyDestructor,      /* key destructor */
+    NULL                       /* val destructor */
+};
+
+static void populateCommandTable(void)
+{
+    commands = dictCreate(&commandDictType, NULL);
+    if (!commands) oom("dictCreate");
+    for (int j = 0; cmdTable[j].proc != NULL; j++) {
+        if (dictAdd(commands, sdsnew(cmdTable[j].name), &cmdTable[j]) != DICT_OK)
+            oom("dictAdd");
     }
 }
 
-static void addReply(redisClient *client, redisObject *obj)
+static struct redisCommand *lookupCommand(sds name)
 {
-    if (listLength(client->reply) == 0 &&
-    		eCreateFileEvent(server.el, client->fd, E_WRITABLE, sendReplyToClient, client, NULL) == E_ERR) return;
-    if (!listAddNodeTail(client->reply, obj)) oom("listAddNodeTail");
-    incrRefCount(obj);
+    dictEntry *de = dictFind(commands, name);
+    return de ? dictGetEntryVal(de) : NULL;
 }
 
-static void addReplySds(redisClient *client, sds s)
+/* ================================ Zero copy =============================== */
+
+/* With "zerocopythreshold N" the replies of at least N bytes are sent
+ * with MSG_ZEROCOPY: the kernel transmits big values straight from the
+ * object instead of copying them, at the price of a page pinning and a
+ * completion to read back from the socket error queue. */
+
+/* The I/O threads can't read the server state (it is thread local), so
+ * the threshold is read from the client zero copy state. */
+static int isZeroCopyReply(redisClient *client, redisObject *obj)
 {
-    redisObject *obj = createObject(REDIS_STRING, s);
-    addReply(client, obj);
-    decrRefCount(obj);
+    return client->zc && sdslen(obj->ptr) >= client->zc->threshold;
 }
 
-/* resetClient prepare the client to process the next command */
-static void resetClient(redisClient *client)
+static zeroCopyState *createZeroCopyState(int fd)
 {
-    freeClientArgv(client);
-    client->bulklen = -1;
+    zeroCopyState *zc = malloc(sizeof(*zc));
+    if (!zc || (zc->pins = listCreate()) == NULL) oom("createZeroCopyState");
+    zc->fd = fd;
+    zc->threshold = server.zerocopythreshold;
+    zc->seq = 0;
+    zc->done = 0;
+    zc->orphaned = 0;
+    return zc;
 }
 
-/* If this function gets called we already read a whole
- * command, arguments are in the client argv/argc fields.
- * processCommand() execute the command or prepare the
- * server for a bulk read from the client.
- *
- * If 1 is returned the client is still alive and valid and
- * other operations can be performed by the caller. Otherwise
- * if 0 is returned the client was destroyed (i.e. after QUIT). */
-static int processCommand(redisClient *client)
-{
-    sdstolower(client->argv[0]);
-    /* The QUIT command is handled as a special case. Normal command
-     * procs are unable to close the client connection safely */
-    if (!strcmp(client->argv[0], "quit")) {
-        freeClient(client);
-        return 0;
+static void freeZeroCopyState(zeroCopyState *zc)
+{
+    listNode *node;
+    while ((node = listFirst(zc->pins)) != NULL) {
+        zeroCopyPin *pin = listNodeValue(node);
+        decrRefCount(pin->obj);
+        free(pin);
+        listDelNode(zc->pins, node);
     }
-    struct redisCommand *cmd = lookupCommand(client->argv[0]);
-    if (!cmd) {
-        addReplySds(client, sdsnew("-ERR unknown command\r\n"));
-        resetClient(client);
-        return 1;
-    } else if (cmd->argc != client->argc) {
-        addReplySds(client, sdsnew("-ERR wrong number of arguments\r\n"));
-        resetClient(client);
-        return 1;
-    } else if (cmd->type == REDIS_CMD_BULK && client->bulklen == -1) {
-        int bulklen = atoi(client->argv[client->argc-1]);
-        sdsfree(client->argv[client->argc-1]);
-        client->argc--;
-        client->argv[client->argc] = NULL;
-        if (bulklen < 0 || bulklen > 1024*1024*1024) {
-            addReplySds(client, sdsnew("-ERR invalid bulk write count\r\n"));
-            resetClient(client);
-            return 1;
-        }
-        client->bulklen = bulklen + 2; /* add two bytes for CR+LF */
-        /* It is possible that the bulk read is already in the
-         * buffer. Check this condition and handle it accordingly */
-        if ((signed)sdslen(client->querybuf) >= client->bulklen) {
-            client->argv[client->argc] = sdsnewlen(client->querybuf, client->bulklen-2);
-            client->argc++;
-            client->querybuf = sdsrange(client->querybuf, client->bulklen, -1);
-        } else {
-            return 1;
-        }
+    listRelease(zc->pins);
+    free(zc);
+}
+
+/* Keep a sent object alive until the sends issued so far complete */
+static void zeroCopyPinObject(zeroCopyState *zc, redisObject *obj)
+{
+    zeroCopyPin *pin = malloc(sizeof(*pin));
+    if (!pin) oom("zeroCopyPinObject");
+    pin->obj = obj;
+    pin->seq = zc->seq;
+    incrRefCount(obj);
+    if (!listAddNodeTail(zc->pins, pin)) oom("listAddNodeTail");
+}
+
+/* Release the objects of the completed sends. Returns the number of
+ * objects still pinned. */
+static int zeroCopyRelease(zeroCopyState *zc)
+{
+    zc->done = netZeroCopyCompleted(zc->fd, zc->done);
+    listNode *node;
+    while ((node = listFirst(zc->pins)) != NULL) {
+        zeroCopyPin *pin = listNodeValue(node);
+        if ((int)(zc->done - pin->seq) < 0) break;
+        decrRefCount(pin->obj);
+        free(pin);
+        listDelNode(zc->pins, node);
     }
-    /* Exec the command */
-    cmd->proc(client);
-    resetClient(client);
+    return listLength(zc->pins);
+}
+
+/* Called when the client is freed. If sends are still in flight the
+ * socket is kept open until they complete, see zeroCopyOrphansCron().
+ * Returns 1 in this case. */
+static int zeroCopyOrphan(zeroCopyState *zc)
+{
+    if (!zeroCopyRelease(zc)) {
+        freeZeroCopyState(zc);
+        return 0;
+    }
+    zc->orphaned = server.unixtime;
+    if (!listAddNodeTail(server.zcorphans, zc)) oom("listAddNodeTail");
     return 1;
 }
 
-static void readQueryFromClient(eEventLoop *el, int fd, void *privdata, int mask)
+/* Close the sockets of the freed clients once their sends complete. A
+ * peer not reading anymore is reset, that drops the data still queued. */
+static void zeroCopyOrphansCron(void)
 {
-    REDIS_NOTUSED(el);
-    REDIS_NOTUSED(mask);
-    redisClient *client = (redisClient *) privdata;
-    char buf[REDIS_QUERYBUF_LEN];
-    int nread = read(fd, buf, REDIS_QUERYBUF_LEN);
-    if (nread == -1) {
-        if (errno == EAGAIN) {
-            nread = 0;
+    listNode *node = listFirst(server.zcorphans);
+    while (node) {
+        listNode *next = listNextNode(node);
+        zeroCopyState *zc = listNodeValue(node);
+        if (!zeroCopyRelease(zc)) {
+            close(zc->fd);
+        } else if (server.unixtime - zc->orphaned > REDIS_ZEROCOPY_ORPHAN_TIMEOUT) {
+            netAbort(zc->fd);
         } else {
-            redisLog(REDIS_DEBUG, "Reading from client: %s", strerror(errno));
-            freeClient(client);
-            return;
+            node = next;
+            continue;
         }
-    } else if (nread == 0) {
-        redisLog(REDIS_DEBUG, "Client closed connection");
-        freeClient(client);
-        return;
+        freeZeroCopyState(zc);
+        listDelNode(server.zcorphans, node);
+        node = next;
     }
-    if (nread) {
-        client->querybuf = sdscatlen(client->querybuf, buf, nread);
-        client->lastinteraction = time(NULL);
-    } else {
-        return;
+}
+
+/* Send a big reply without copying it. Falls back to a plain write if
+ * the kernel has no memory left for the completion notifications. */
+static int writeZeroCopy(redisClient *client, struct iovec *iov)
+{
+#ifdef MSG_ZEROCOPY
+    int nwritten = send(client->fd, iov->iov_base, iov->iov_len, MSG_ZEROCOPY);
+    if (nwritten != -1) {
+        client->zc->seq++;
+        return nwritten;
     }
+    if (errno != ENOBUFS) return -1;
+#endif
+    return write(client->fd, iov->iov_base, iov->iov_len);
+}
+
+/* ================================ Replies ================================ */
+
+static int clientHasPendingReplies(redisClient *client)
+{
+    return client->bufpos || listLength(client->reply);
+}
 
-again:
-    if (client->bulklen == -1) {
-        /* Read the first line of the query */
-        char *p = strchr(client->querybuf, '\n');
-        if (p) {
-            sds query = client->querybuf;
-            client->querybuf = sdsempty();
-            size_t querylen = 1 + (p - query);
-            if (sdslen(query) > querylen) {
-                /* leave data after the first line of the query in the buffer */
-                client->querybuf = sdscatlen(client->querybuf, query+querylen, sdslen(query)-querylen);
+/* Write as much of the reply buffer and list as the socket accepts.
+ * Nothing is freed and only the client is touched, so this is safe to
+ * call from an I/O thread: the outcome is left in the client io* fields
+ * and applied by handleClientWrite() in the main thread.
+ *
+ * The buffer and the reply objects are sent with writev(), up to IOV_MAX
+ * at a time. If that's not enough the socket is corked meanwhile, so a
+ * big multi part reply doesn't leave as many small segments. Zero copy
+ * replies are sent alone, see writeZeroCopy(). */
+static void writeClientSocket(redisClient *client)
+{
+    struct iovec iov[IOV_MAX];
+    int nwritten = 0, totwritten = 0, corked = 0;
+    listNode *node = listFirst(client->reply);
+    client->iosentobjs = 0;
+    client->ioerrno = 0;
+    while (client->bufpos || node) {
+        int iovcnt = 0, offset = client->sentlen, zerocopy = 0;
+        if (client->bufpos) {
+            iov[iovcnt].iov_base = client->buf + offset;
+            iov[iovcnt].iov_len = client->bufpos - offset;
+            iovcnt++;
+            offset = 0;
+        }
+        listNode *next = node;
+        while (next && iovcnt < IOV_MAX) {
+            redisObject *obj = listNodeValue(next);
+            if (isZeroCopyReply(client, obj)) {
+                if (iovcnt) break;
+                zerocopy = 1;
             }
-            *p = '\0'; /* remove "\n" */
-            if (*(p - 1) == '\r') *(p - 1) = '\0'; /* and "\r" if any */
-            sdsupdatelen(query);
-            /* Now we can split the query in arguments */
-            if (sdslen(query) == 0) {
-                /* Ignore empty query */
-                sdsfree(query);
-                return;
+            iov[iovcnt].iov_base = (char*)obj->ptr + offset;
+            iov[iovcnt].iov_len = sdslen(obj->ptr) - offset;
+            iovcnt++;
+            offset = 0;
+            next = listNextNode(next);
+            if (zerocopy) break;
+        }
+        if (next && !corked && !(client->flags & REDIS_UNIX_SOCKET)) {
+            netTcpCork(NULL, client->fd, 1);
+            corked = 1;
+        }
+        if (zerocopy)
+            nwritten = writeZeroCopy(client, iov);
+        else
+            nwritten = writev(client->fd, iov, iovcnt);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
+        /* Consume the written bytes, the write may stop in the middle of
+         * the buffer or of any object. */
+        if (client->bufpos) {
+            int left = client->bufpos - client->sentlen;
+            if (nwritten < left) {
+                client->sentlen += nwritten;
+                continue;
             }
-            int argc;
-            sds *argv = sdssplitlen(query, sdslen(query), " ", 1, &argc);
-            sdsfree(query);
-            if (argv == NULL) oom("Splitting query in token");
-            for (int j = 0; j < argc && j < REDIS_MAX_ARGS; j++) {
-                if (sdslen(argv[j])) {
-                    client->argv[client->argc] = argv[j];
-                    client->argc++;
-                } else {
-                    sdsfree(argv[j]);
-                }
+            nwritten -= left;
+            client->bufpos = 0;
+            client->sentlen = 0;
+        }
+        while (node) {
+            redisObject *obj = listNodeValue(node);
+            int left = sdslen(obj->ptr) - client->sentlen;
+            if (nwritten < left) {
+                client->sentlen += nwritten;
+                break;
             }
-            free(argv);
-            /* Execute the command. If the client is still valid
-             * after processCommand() return and there is something
-             * on the query buffer try to process the next command. */
-            if (processCommand(client) && sdslen(client->querybuf)) goto again;
-            return;
-        } else if (sdslen(client->querybuf) >= 1024) {
-            redisLog(REDIS_DEBUG, "Client protocol error");
+            nwritten -= left;
+            client->sentlen = 0;
+            client->iosentobjs++;
+            node = listNextNode(node);
+        }
+    }
+    if (nwritten == -1 && errno != EAGAIN) client->ioerrno = errno;
+    if (corked) netTcpCork(NULL, client->fd, 0);
+    client->iowritten = totwritten;
+}
+
+/* Release the reply objects sent by writeClientSocket(). Returns
+ * REDIS_ERR if the client was freed because of a write error. */
+static int handleClientWrite(redisClient *client)
+{
+    for (int j = 0; j < client->iosentobjs; j++) {
+        listNode *node = listFirst(client->reply);
+        redisObject *obj = listNodeValue(node);
+        if (isZeroCopyReply(client, obj)) zeroCopyPinObject(client->zc, obj);
+        client->replybytes -= sdslen(obj->ptr);
+        listDelNode(client->reply, node);
+    }
+    client->iosentobjs = 0;
+    if (client->zc && listLength(client->zc->pins)) zeroCopyRelease(client->zc);
+    if (client->ioerrno) {
+        redisLog(REDIS_DEBUG, "Error writing to client: %s", strerror(client->ioerrno));
+        freeClient(client);
+        return REDIS_ERR;
+    }
+    if (client->iowritten > 0) touchClient(client);
+    return REDIS_OK;
+}
+
+/* Write as much of the reply list as the socket accepts. Returns
+ * REDIS_ERR if the client was freed because of a write error. */
+static int writeToClient(redisClient *client)
+{
+    writeClientSocket(client);
+    return handleClientWrite(client);
+}
+
+static int resumeClientReads(redisClient *client);
+
+static void sendReplyToClient(eEventLoop *el, int fd, void *privdata, int mask)
+{
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(mask);
+    redisClient *client = privdata;
+    server.currentcmd = NULL;
+    if (writeToClient(client) == REDIS_ERR) return;
+    if (!clientHasPendingReplies(client)) eDeleteFileEvent(server.el, client->fd, E_WRITABLE);
+    resumeClientReads(client);
+}
+
+/* ================================ I/O threads ============================== */
+
+/* With "iothreads N" the socket reads (and the parsing of inline
+ * commands) and the reply writes of the clients served in an event loop
+ * iteration are spread over N threads. Commands are still executed one
+ * at a time by the main thread, in order, so the keyspace needs no
+ * locking. The main thread waits for every job to complete, while a job
+ * runs the threads only touch their own clients. */
+
+static void readClientSocket(redisClient *client);
+static int parseRequest(redisClient *client);
+
+static void ioThreadsProcess(int id)
+{
+    for (int j = id; j < io.jobslen; j += io.threads) {
+        redisClient *client = io.jobs[j];
+        if (io.op == REDIS_IO_WRITE) {
+            writeClientSocket(client);
+        } else {
+            readClientSocket(client);
+            if (client->ionread > 0 && (client->argc == 0 || client->multibulklen))
+                parseRequest(client);
+        }
+    }
+}
+
+static void *ioThreadMain(void *arg)
+{
+    int id = (long) arg;
+    unsigned long round = 0;
+    pthread_mutex_lock(&io.mutex);
+    while (1) {
+        while (io.round == round) pthread_cond_wait(&io.start, &io.mutex);
+        round = io.round;
+        pthread_mutex_unlock(&io.mutex);
+        ioThreadsProcess(id);
+        pthread_mutex_lock(&io.mutex);
+        if (--io.pending == 0) pthread_cond_signal(&io.done);
+    }
+    return NULL;
+}
+
+static void initIOThreads(void)
+{
+    if (server.iothreads == 1) return;
+    io.threads = server.iothreads;
+    io.tids = malloc(sizeof(pthread_t)*io.threads);
+    if (!io.tids) oom("I/O threads initialization");
+    pthread_mutex_init(&io.mutex, NULL);
+    pthread_cond_init(&io.start, NULL);
+    pthread_cond_init(&io.done, NULL);
+    io.round = 0;
+    io.pending = 0;
+    for (int j = 1; j < io.threads; j++) {
+        if (pthread_create(&io.tids[j], NULL, ioThreadMain, (void*)(long)j) != 0) {
+            redisLog(REDIS_WARNING, "Can't create I/O thread: %s", strerror(errno));
+            exit(1);
+        }
+    }
+    redisLog(REDIS_NOTICE, "%d I/O threads started", server.iothreads);
+}
+
+/* Move the clients of a pending list in the job array, clearing 'flag' */
+static void ioThreadsSetJobs(list *clients, int flag)
+{
+    int len = listLength(clients);
+    if (len > server.iojobssize) {
+        redisClient **jobs = realloc(server.iojobs, sizeof(redisClient*)*len);
+        if (!jobs) oom("I/O threads jobs");
+        server.iojobs = jobs;
+        server.iojobssize = len;
+    }
+    server.iojobslen = 0;
+    listNode *node;
+    while ((node = listFirst(clients)) != NULL) {
+        redisClient *client = listNodeValue(node);
+        client->flags &= ~flag;
+        if (flag == REDIS_PENDING_READ) client->pendingreadnode = NULL;
+        else client->pendingwritenode = NULL;
+        listDelNode(clients, node);
+        server.iojobs[server.iojobslen++] = client;
+    }
+}
+
+/* Run the current job on all the threads and wait for it to complete */
+static void ioThreadsRun(int op)
+{
+    pthread_mutex_lock(&io.mutex);
+    io.op = op;
+    io.jobs = server.iojobs;
+    io.jobslen = server.iojobslen;
+    io.pending = io.threads-1;
+    io.round++;
+    pthread_cond_broadcast(&io.start);
+    pthread_mutex_unlock(&io.mutex);
+    ioThreadsProcess(0);
+    pthread_mutex_lock(&io.mutex);
+    while (io.pending) pthread_cond_wait(&io.done, &io.mutex);
+    pthread_mutex_unlock(&io.mutex);
+}
+
+/* Waking up the threads costs more than a few syscalls, use them only
+ * when there are enough clients to serve. */
+static int ioThreadsWorthIt(list *clients)
+{
+    return server.iothreads > 1 && (int)listLength(clients) >= server.iothreads*2;
+}
+
+static void handleClientRead(redisClient *client);
+
+static void handleClientsWithPendingReads(void)
+{
+    if (!listLength(server.clients_pending_read)) return;
+    int threaded = ioThreadsWorthIt(server.clients_pending_read);
+    ioThreadsSetJobs(server.clients_pending_read, REDIS_PENDING_READ);
+    if (threaded) ioThreadsRun(REDIS_IO_READ);
+    /* The commands run here, out of the file event callbacks: they are
+     * accounted as callbacks of their clients, for the stall detector. */
+    for (int j = 0; j < server.iojobslen; j++) {
+        redisClient *client = server.iojobs[j];
+        int fd = client->fd;
+        long long start = eGetMonotonicNs();
+        if (!threaded) readClientSocket(client);
+        handleClientRead(client);
+        eTrackFileEvent(server.el, fd, start);
+    }
+}
+
+/* Called before the event loop sleeps. Replies produced in this
+ * iteration are written right away, so a request doesn't have to wait
+ * a whole loop iteration for its socket to be reported writable. Only
+ * the clients whose socket buffer is full get a writable handler. */
+static void handleClientsWithPendingWrites(void)
+{
+    if (!listLength(server.clients_pending_write)) return;
+    int threaded = ioThreadsWorthIt(server.clients_pending_write);
+    int resumed = 0;
+    ioThreadsSetJobs(server.clients_pending_write, REDIS_PENDING_WRITE);
+    if (threaded) ioThreadsRun(REDIS_IO_WRITE);
+    for (int j = 0; j < server.iojobslen; j++) {
+        redisClient *client = server.iojobs[j];
+        if (!threaded) writeClientSocket(client);
+        if (handleClientWrite(client) == REDIS_ERR) continue;
+        if (clientHasPendingReplies(client) &&
+            eCreateFileEvent(server.el, client->fd, E_WRITABLE, sendReplyToClient, client, NULL) == E_ERR) {
             freeClient(client);
-            return;
+            continue;
+        }
+        if (client->flags & REDIS_READ_PAUSED) {
+            /* May run the commands already read, see handleClientsWithPendingReads() */
+            int fd = client->fd;
+            long long start = eGetMonotonicNs();
+            resumed |= resumeClientReads(client);
+            eTrackFileEvent(server.el, fd, start);
+        }
+    }
+    /* Flush the replies of the commands the resumed clients had queued */
+    if (resumed) {
+        freeClientsInAsyncFreeQueue();
+        handleClientsWithPendingWrites();
+    }
+}
+
+static int shardFlush(void);
+static void shardProcessMessages(void);
+
+static void beforeSleep(struct eEventLoop *eventLoop)
+{
+    REDIS_NOTUSED(eventLoop);
+    handleClientsWithPendingReads();
+    /* Hand the calls and replies to the other shards and wake them up. If
+     * a queue is full keep serving our queues until it gets drained. */
+    if (server.shards > 1) {
+        while (shardFlush()) {
+            shardProcessMessages();
+            sched_yield();
         }
+    }
+    freeClientsInAsyncFreeQueue();
+    handleClientsWithPendingWrites();
+}
+
+static void afterSleep(struct eEventLoop *eventLoop)
+{
+    REDIS_NOTUSED(eventLoop);
+    updateCachedTime();
+}
+
+/* Called by the event loop for every callback running longer than
+ * server.stallthreshold milliseconds. */
+static void stallHandler(struct eEventLoop *eventLoop, int fd, long long id, long long usec)
+{
+    REDIS_NOTUSED(eventLoop);
+    redisClient *client;
+    if (fd == -1) {
+        redisLog(REDIS_WARNING, "Event loop stall: %s took %lld us",
+            id == server.cronid ? "serverCron" : "time event", usec);
+    } else if ((client = lookupClientByFd(fd)) != NULL) {
+        redisLog(REDIS_WARNING, "Event loop stall: client fd %d took %lld us, "
+            "last command '%s', %zu query bytes, %llu reply bytes",
+            fd, usec, server.currentcmd ? server.currentcmd : "none",
+            sdslen(client->querybuf) - client->qbpos, client->replybytes);
+    } else if (server.currentcmd) {
+        redisLog(REDIS_WARNING, "Event loop stall: client fd %d took %lld us, last command '%s'",
+            fd, usec, server.currentcmd);
+    } else {
+        redisLog(REDIS_WARNING, "Event loop stall: fd %d took %lld us", fd, usec);
+    }
+}
+
+/* Queue the client to be flushed before sleeping, unless it already
+ * has pending data (then it is queued or has a writable handler). */
+static void prepareClientToWrite(redisClient *client)
+{
+    if (!clientHasPendingReplies(client) &&
+        !(client->flags & (REDIS_PENDING_WRITE|REDIS_SHARD_CLIENT))) {
+        if (!listAddNodeHead(server.clients_pending_write, client)) oom("listAddNodeHead");
+        client->pendingwritenode = listFirst(server.clients_pending_write);
+        client->flags |= REDIS_PENDING_WRITE;
+    }
+}
+
+/* Copy a reply in the client static buffer, so that a pipeline of small
+ * replies costs no allocation and a single write. Once something is in
+ * the reply list the buffer can't be used, it would be sent first. */
+static int addReplyToBuffer(redisClient *client, char *s, size_t len)
+{
+    if (listLength(client->reply) || len > sizeof(client->buf) - client->bufpos)
+        return REDIS_ERR;
+    memcpy(client->buf + client->bufpos, s, len);
+    client->bufpos += len;
+    return REDIS_OK;
+}
+
+static struct outputLimit *clientOutputLimit(redisClient *client)
+{
+    int class = (client->flags & REDIS_UNIX_SOCKET) ? REDIS_CLIENT_UNIX : REDIS_CLIENT_TCP;
+    return &server.outputlimits[class];
+}
+
+/* A client not reading its replies fast enough is not read anymore once
+ * over the soft limit, so it can't queue more replies, and it is closed
+ * if over the hard limit or over the soft one for too long. Returns 1 if
+ * the client should be closed. */
+static int clientOverOutputLimits(redisClient *client)
+{
+    if (client->flags & REDIS_SHARD_CLIENT) return 0;
+    struct outputLimit *l = clientOutputLimit(client);
+    if (l->hard && client->replybytes >= l->hard) {
+        redisLog(REDIS_NOTICE, "Client over the output hard limit (%llu bytes), closing it",
+            client->replybytes);
+        return 1;
+    }
+    if (!l->soft || client->replybytes < l->soft) {
+        client->softlimitsince = 0;
+        return 0;
+    }
+    if (!client->softlimitsince) client->softlimitsince = server.unixtime;
+    if (l->softseconds && server.unixtime - client->softlimitsince > l->softseconds) {
+        redisLog(REDIS_NOTICE, "Client over the output soft limit for %d seconds, closing it",
+            (int)l->softseconds);
+        return 1;
+    }
+    if (!(client->flags & REDIS_READ_PAUSED)) {
+        eDeleteFileEvent(server.el, client->fd, E_READABLE);
+        client->flags |= REDIS_READ_PAUSED;
+    }
+    return 0;
+}
+
+static void readQueryFromClient(eEventLoop *el, int fd, void *privdata, int mask);
+static void processInputBuffer(redisClient *client);
+
+/* Read again from a paused client whose replies went under the soft
+ * limit. The commands already in the query buffer run right away, so
+ * the client may be freed. Returns 1 if reading was resumed. */
+static int resumeClientReads(redisClient *client)
+{
+    struct outputLimit *l = clientOutputLimit(client);
+    if (!(client->flags & REDIS_READ_PAUSED) || client->replybytes >= l->soft) return 0;
+    client->flags &= ~REDIS_READ_PAUSED;
+    client->softlimitsince = 0;
+    if (eCreateFileEvent(server.el, client->fd, E_READABLE, readQueryFromClient, client, NULL) == E_ERR) {
+        freeClient(client);
+        return 1;
+    }
+    processInputBuffer(client);
+    return 1;
+}
+
+static void addReplyToList(redisClient *client, redisObject *obj)
+{
+    if (!listAddNodeTail(client->reply, obj)) oom("listAddNodeTail");
+    client->replybytes += sdslen(obj->ptr);
+    if (clientOverOutputLimits(client)) freeClientAsync(client);
+}
+
+static void addReply(redisClient *client, redisObject *obj)
+{
+    if (client->flags & REDIS_CLOSE_ASAP) return;
+    prepareClientToWrite(client);
+    if (!isZeroCopyReply(client, obj) &&
+        addReplyToBuffer(client, obj->ptr, sdslen(obj->ptr)) == REDIS_OK) return;
+    incrRefCount(obj);
+    addReplyToList(client, obj);
+}
+
+/* Add the 'len' bytes at 's' to the reply, they are copied */
+static void addReplyString(redisClient *client, char *s, size_t len)
+{
+    if (client->flags & REDIS_CLOSE_ASAP) return;
+    prepareClientToWrite(client);
+    if (addReplyToBuffer(client, s, len) == REDIS_OK) return;
+    addReplyToList(client, createObject(REDIS_STRING, sdsnewlen(s, len)));
+}
+
+/* Reply with the line "<ll>\r\n", an integer reply or the length of a bulk
+ * or multi bulk reply. Small values use the shared objects. */
+static void addReplyLongLong(redisClient *client, long long ll)
+{
+    if (ll >= 0 && ll < REDIS_SHARED_INTEGERS) {
+        addReply(client, sharedObjs.integers[ll]);
+        return;
+    }
+    char buf[32];
+    int len = ll2string(buf, sizeof(buf), ll);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    addReplyString(client, buf, len);
+}
+
+/* Reply with the string object 'obj' as a bulk */
+static void addReplyBulk(redisClient *client, redisObject *obj)
+{
+    addReplyLongLong(client, sdslen(obj->ptr));
+    addReply(client, obj);
+    addReply(client, sharedObjs.crlf);
+}
+
+/* Bulk replies report errors with a negative length */
+static void addReplyBulkError(redisClient *client, char *err)
+{
+    size_t len = strlen(err);
+    addReplyLongLong(client, -(long long)len);
+    addReplyString(client, err, len);
+    addReply(client, sharedObjs.crlf);
+}
+
+static void addReplySds(redisClient *client, sds s)
+{
+    if (client->flags & REDIS_CLOSE_ASAP) {
+        sdsfree(s);
+        return;
+    }
+    prepareClientToWrite(client);
+    if (addReplyToBuffer(client, s, sdslen(s)) == REDIS_OK) {
+        sdsfree(s);
+        return;
+    }
+    addReplyToList(client, createObject(REDIS_STRING, s));
+}
+
+/* Execute a command. In shard mode the commands that may access the keys
+ * of every shard run with the world stopped, see commandShard(). */
+static void call(redisClient *client, struct redisCommand *cmd, int stop)
+{
+    if (stop) stopWorld();
+    server.currentcmd = cmd->name;
+    cmd->proc(client);
+    if (stop) resumeWorld();
+}
+
+static void shardCall(redisClient *client, struct redisCommand *cmd, int shard);
+
+/* Return the shard owning the keys of the command, or -1 if they may be
+ * in more than one shard: then the world is stopped to run it. A multi
+ * key command whose keys all hash to the same shard is executed there
+ * like a single key one. */
+static int commandShard(redisClient *client, struct redisCommand *cmd)
+{
+    if (cmd->flags & REDIS_CMD_ADMIN) return 0;
+    if (cmd->firstkey == 0) return -1; /* i.e. KEYS, every key is accessed */
+    int last = cmd->lastkey < 0 ? client->argc + cmd->lastkey : cmd->lastkey;
+    int shard = keyShard(client->argv[cmd->firstkey]);
+    for (int j = cmd->firstkey + cmd->keystep; j <= last; j += cmd->keystep) {
+        if (keyShard(client->argv[j]) != shard) return -1;
+    }
+    return shard;
+}
+
+/* resetClient prepare the client to process the next command */
+static void resetClient(redisClient *client)
+{
+    freeClientArgv(client);
+    client->reqtype = 0;
+    client->multibulklen = 0;
+    client->bulklen = -1;
+}
+
+/* Move the bulk argument from the query buffer to the argv. A big one
+ * read alone in the query buffer is not copied, the buffer itself
+ * becomes the argument. */
+static void addBulkArgument(redisClient *client)
+{
+    if (client->qbpos == 0 && client->bulklen >= REDIS_BIG_ARG &&
+        sdslen(client->querybuf) == (size_t)client->bulklen) {
+        clientArgvReserve(client, 1);
+        sdsfree(client->argv[client->argc]);
+        client->argv[client->argc++] = client->querybuf;
+        sdsIncrLen(client->querybuf, -2); /* remove the CRLF */
+        client->querybuf = sdsempty();
     } else {
-        /* Bulk read handling. Note that if we are at this point
-           the client already sent a command terminated with a newline,
-           we are reading the bulk data that is actually the last
-           argument of the command. */
-        if (client->bulklen <= (int)sdslen(client->querybuf)) {
-            /* Copy everything but the final CRLF as final argument */
-            client->argv[client->argc] = sdsnewlen(client->querybuf, client->bulklen-2);
-            client->argc++;
-            client->querybuf = sdsrange(client->querybuf, client->bulklen, -1);
-            processCommand(client);
+        addArgument(client, client->querybuf+client->qbpos, client->bulklen-2);
+        client->qbpos += client->bulklen;
+    }
+}
+
+/* A big argument gets a query buffer for itself, of the right size: it
+ * is read there and becomes the argument, see addBulkArgument(). */
+static void makeRoomForBigArgument(redisClient *client)
+{
+    size_t pending = sdslen(client->querybuf) - client->qbpos;
+    if (client->bulklen < REDIS_BIG_ARG || pending >= (size_t)client->bulklen) return;
+    client->querybuf = sdsrange(client->querybuf, client->qbpos, -1);
+    client->qbpos = 0;
+    client->querybuf = sdsMakeRoomForExact(client->querybuf, client->bulklen - pending);
+}
+
+/* If this function gets called we already read a whole
+ * command, arguments are in the client argv/argc fields.
+ * processCommand() execute the command or prepare the
+ * server for a bulk read from the client. The client is never freed
+ * here, QUIT and the output limits close it asynchronously. */
+static void processCommand(redisClient *client)
+{
+    struct redisCommand *cmd = lookupCommand(client->argv[0]);
+    if (!cmd) {
+        addReplySds(client, sdsnew("-ERR unknown command\r\n"));
+        resetClient(client);
+        return;
+    } else if ((cmd->argc > 0 && cmd->argc != client->argc) ||
+               client->argc < -cmd->argc) {
+        /* A negative arity means at least that many arguments */
+        addReplySds(client, sdsnew("-ERR wrong number of arguments\r\n"));
+        resetClient(client);
+        return;
+    } else if (client->reqtype == REDIS_REQ_INLINE && cmd->type == REDIS_CMD_BULK &&
+               client->bulklen == -1) {
+        /* Inline commands send the last argument as a bulk, after the
+         * line ending with its length */
+        int bulklen = atoi(client->argv[client->argc-1]);
+        client->argc--; /* the bulk goes in the same argv slot */
+        if (bulklen < 0 || bulklen > REDIS_BULK_MAX) {
+            addReplySds(client, sdsnew("-ERR invalid bulk write count\r\n"));
+            resetClient(client);
+            return;
+        }
+        client->bulklen = bulklen + 2; /* add two bytes for CR+LF */
+        /* It is possible that the bulk read is already in the
+         * buffer. Check this condition and handle it accordingly */
+        if (sdslen(client->querybuf)-client->qbpos >= (size_t)client->bulklen) {
+            addBulkArgument(client);
+        } else {
+            makeRoomForBigArgument(client);
             return;
         }
     }
+    /* In shard mode the commands are executed by the shard owning the keys */
+    int stop = 0;
+    if (server.shards > 1 && !(cmd->flags & REDIS_CMD_NOKEY)) {
+        int shard = commandShard(client, cmd);
+        if (shard == -1) {
+            stop = 1;
+        } else if (shard != server.shardid) {
+            shardCall(client, cmd, shard);
+            resetClient(client);
+            return;
+        } else {
+            stop = (cmd->flags & REDIS_CMD_ADMIN) != 0;
+        }
+    }
+    /* Exec the command */
+    call(client, cmd, stop);
+    resetClient(client);
 }
 
-static int createClient(int fd)
+/* Parse an inline command line of the query buffer in the client argv.
+ * Returns 1 if the line was parsed (argc is 0 for an empty line), 0 if
+ * more data is needed and -1 on protocol error. Like readClientSocket()
+ * this is called by the I/O threads, so it must not touch anything but
+ * the client. */
+static int parseInlineQuery(redisClient *client)
+{
+    /* Read the first line of the query, it is not copied: the parsed
+     * bytes are skipped by moving the query buffer cursor. */
+    char *query = client->querybuf + client->qbpos;
+    size_t avail = sdslen(client->querybuf) - client->qbpos;
+    char *p = memchr(query, '\n', avail);
+    if (!p) return avail >= REDIS_INLINE_MAX ? -1 : 0;
+    size_t querylen = p - query;
+    client->qbpos += querylen + 1;
+    if (querylen && query[querylen-1] == '\r') querylen--; /* and "\r" if any */
+    /* Now we can split the query in arguments, skipping empty ones */
+    char *end = query + querylen;
+    while (query < end) {
+        char *sep = memchr(query, ' ', end-query);
+        if (!sep) sep = end;
+        if (sep != query) addArgument(client, query, sep-query);
+        query = sep + 1;
+    }
+    return 1;
+}
+
+/* Parse the "<prefix><number>\r\n" line starting a multi bulk command or
+ * argument. The number must be in the min-max range. Same return values
+ * of parseInlineQuery(), nothing is consumed unless 1 is returned. */
+static int parseRequestNumber(redisClient *client, char prefix, long long min,
+                              long long max, long long *value)
+{
+    char *line = client->querybuf + client->qbpos;
+    size_t avail = sdslen(client->querybuf) - client->qbpos;
+    char *p = memchr(line, '\r', avail);
+    if (!p) return avail >= REDIS_INLINE_MAX ? -1 : 0;
+    if ((size_t)(p-line) + 2 > avail) return 0; /* the "\n" is missing */
+    if (line[0] != prefix || p[1] != '\n' || p == line+1) return -1;
+    char *eptr;
+    *value = strtoll(line+1, &eptr, 10);
+    if (eptr != p || *value < min || *value > max) return -1;
+    client->qbpos += (p-line) + 2;
+    return 1;
+}
+
+/* Parse a multi bulk command. It may take many calls, as its bytes
+ * arrive: the arguments parsed so far stay in the argv, multibulklen
+ * counts the missing ones and bulklen is the length of the next one
+ * once its "$<len>" line was parsed. Same return values of
+ * parseInlineQuery(), like it this is called by the I/O threads. */
+static int parseMultibulkQuery(redisClient *client)
 {
-    netNonBlock(NULL, fd);
-    netTcpNoDelay(NULL, fd);
-    redisClient *client = malloc(sizeof(struct redisClient));
+    long long value;
+    int retval;
+    if (client->multibulklen == 0) {
+        retval = parseRequestNumber(client, '*', 0, REDIS_MULTIBULK_MAX, &value);
+        if (retval != 1) return retval;
+        if (value == 0) return 1; /* Ignore empty command */
+        client->multibulklen = value;
+        /* Don't trust the count to allocate the argv at once */
+        clientArgvReserve(client, value < 1024 ? value : 1024);
+    }
+    while (client->multibulklen) {
+        if (client->bulklen == -1) {
+            retval = parseRequestNumber(client, '$', 0, REDIS_BULK_MAX, &value);
+            if (retval != 1) return retval;
+            client->bulklen = value + 2; /* add two bytes for CR+LF */
+            makeRoomForBigArgument(client);
+        }
+        if (sdslen(client->querybuf)-client->qbpos < (size_t)client->bulklen) return 0;
+        addBulkArgument(client);
+        client->bulklen = -1;
+        client->multibulklen--;
+    }
+    return 1;
+}
+
+/* Parse the next command of the query buffer in the client argv. The
+ * request type is given by its first byte: '*' starts a multi bulk
+ * command, anything else an inline one. */
+static int parseRequest(redisClient *client)
+{
+    while (1) {
+        if (!client->reqtype) {
+            if (client->qbpos == sdslen(client->querybuf)) return 0;
+            client->reqtype = client->querybuf[client->qbpos] == '*' ?
+                              REDIS_REQ_MULTIBULK : REDIS_REQ_INLINE;
+        }
+        int retval = client->reqtype == REDIS_REQ_MULTIBULK ?
+                     parseMultibulkQuery(client) : parseInlineQuery(client);
+        if (retval != 1 || client->argc) return retval;
+        client->reqtype = 0; /* empty command, parse the next one */
+    }
+}
+
+/* Execute the commands in the query buffer, as long as they are
+ * complete and the client is still valid. */
+static void processInputBuffer(redisClient *client)
+{
+    while (!(client->flags & (REDIS_SHARD_WAIT|REDIS_READ_PAUSED|REDIS_CLOSE_ASAP))) {
+        if (client->reqtype == REDIS_REQ_INLINE && client->bulklen != -1) {
+            /* Bulk read handling. Note that if we are at this point
+               the client already sent a command terminated with a newline,
+               we are reading the bulk data that is actually the last
+               argument of the command. */
+            if ((size_t)client->bulklen > sdslen(client->querybuf)-client->qbpos) break;
+            /* Everything but the final CRLF is the final argument */
+            addBulkArgument(client);
+        } else if (client->argc == 0 || client->multibulklen) {
+            /* The I/O threads may have parsed the command already */
+            int retval = parseRequest(client);
+            if (retval == 0) break;
+            if (retval == -1) {
+                redisLog(REDIS_DEBUG, "Client protocol error");
+                freeClient(client);
+                return;
+            }
+        }
+        processCommand(client);
+    }
+    /* Drop the parsed commands once, not after every command: parsing a
+     * pipeline stays linear in its size. */
+    if (client->qbpos) {
+        client->querybuf = sdsrange(client->querybuf, client->qbpos, -1);
+        client->qbpos = 0;
+    }
+}
+
+/* Read from the client socket into the query buffer. Safe to call from
+ * an I/O thread: the outcome is left in client->ionread/ioerrno and
+ * handled by handleClientRead() in the main thread. */
+static void readClientSocket(redisClient *client)
+{
+    size_t readlen = REDIS_IOBUF_LEN;
+    /* The rest of a big argument is read at once, in the room already
+     * made for it, see processCommand(). */
+    if (client->bulklen >= REDIS_BIG_ARG) {
+        size_t pending = sdslen(client->querybuf) - client->qbpos;
+        if ((size_t)client->bulklen > pending) readlen = client->bulklen - pending;
+    }
+    client->querybuf = sdsMakeRoomFor(client->querybuf, readlen);
+    int nread = read(client->fd, client->querybuf+sdslen(client->querybuf), readlen);
+    client->ioerrno = nread == -1 ? errno : 0;
+    client->ionread = nread;
+    if (nread > 0) {
+        sdsIncrLen(client->querybuf, nread);
+        if (sdslen(client->querybuf) > client->querybufpeak)
+            client->querybufpeak = sdslen(client->querybuf);
+    }
+}
+
+static void handleClientRead(redisClient *client)
+{
+    server.currentcmd = NULL;
+    if (client->ionread == -1) {
+        if (client->ioerrno == EAGAIN) return;
+        redisLog(REDIS_DEBUG, "Reading from client: %s", strerror(client->ioerrno));
+        freeClient(client);
+        return;
+    } else if (client->ionread == 0) {
+        redisLog(REDIS_DEBUG, "Client closed connection");
+        freeClient(client);
+        return;
+    }
+    touchClient(client);
+    /* The argument being read is already limited by the bulk count check */
+    size_t pending = sdslen(client->querybuf) - client->qbpos;
+    if (pending > (size_t)server.querybuflimit &&
+        (client->bulklen == -1 || pending > (size_t)client->bulklen)) {
+        redisLog(REDIS_NOTICE, "Client over the query buffer limit (%zu bytes), closing it", pending);
+        freeClient(client);
+        return;
+    }
+    processInputBuffer(client);
+}
+
+static void readQueryFromClient(eEventLoop *el, int fd, void *privdata, int mask)
+{
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(fd);
+    REDIS_NOTUSED(mask);
+    redisClient *client = (redisClient *) privdata;
+    /* The completions in the error queue wake us up too */
+    if (client->zc && listLength(client->zc->pins)) zeroCopyRelease(client->zc);
+    if (server.iothreads > 1) {
+        /* Defer the read to beforeSleep, where the I/O threads can do it
+         * together with the reads of the other ready clients. */
+        if (!(client->flags & REDIS_PENDING_READ)) {
+            if (!listAddNodeTail(server.clients_pending_read, client)) oom("listAddNodeTail");
+            client->pendingreadnode = listLast(server.clients_pending_read);
+            client->flags |= REDIS_PENDING_READ;
+        }
+        return;
+    }
+    readClientSocket(client);
+    handleClientRead(client);
+}
+
+/* The socket is already non blocking, see netAccept() */
+static int createClient(int fd, int flags)
+{
+    redisClient *client = allocClient();
     if (!client) return REDIS_ERR;
     client->fd = fd;
     selectDb(client, 0);
-    client->querybuf = sdsempty();
-    client->argc = 0;
+    client->qbpos = 0;
+    client->querybufpeak = 0;
+    client->reqtype = 0;
+    client->multibulklen = 0;
     client->bulklen = -1;
-    if ((client->reply = listCreate()) == NULL) oom("listCreate");
-    listSetFreeMethod(client->reply, decrRefCount);
     client->sentlen = 0;
-    client->lastinteraction = time(NULL);
+    client->bufpos = 0;
+    client->replybytes = 0;
+    client->softlimitsince = 0;
+    client->flags = flags;
+    client->shardcall = NULL;
+    client->zc = NULL;
+    if (server.zerocopythreshold && !(flags & REDIS_UNIX_SOCKET) &&
+        netZeroCopy(NULL, fd) == NET_OK) client->zc = createZeroCopyState(fd);
+    client->lastinteraction = server.monotime;
+    client->clientsnode = client->idlenode = NULL;
+    client->pendingwritenode = client->pendingreadnode = client->closenode = NULL;
     if (eCreateFileEvent(server.el, client->fd, E_READABLE, readQueryFromClient, client, NULL) == E_ERR) {
         freeClient(client);
         return REDIS_ERR;
     }
-    if (!listAddNodeTail(server.clients, client)) oom("listAddNodeTail");
+    linkClient(client);
     return REDIS_OK;
 }
 
+/* TCP and unix socket connections only differ in the accept call */
+static void acceptGenericHandler(int fd, int unixsock)
+{
+    int cport, accepted = 0;
+    char cip[128];
+    long long start = ustime();
+    /* Drain the backlog, so a reconnection storm doesn't overflow it */
+    while (accepted < REDIS_MAX_ACCEPTS_PER_CALL) {
+        int cfd = unixsock ? netUnixAccept(server.neterr, fd) :
+                             netAccept(server.neterr, fd, cip, &cport);
+        if (cfd == NET_ERR) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                redisLog(REDIS_DEBUG, "Accepting client connection: %s", server.neterr);
+            break;
+        }
+        accepted++;
+        if (unixsock) {
+            redisLog(REDIS_DEBUG, "Accepted connection to %s", server.unixsocket);
+        } else {
+            redisLog(REDIS_DEBUG, "Accepted %s:%d", cip, cport);
+            netTcpNoDelay(NULL, cfd);
+        }
+        if (createClient(cfd, unixsock ? REDIS_UNIX_SOCKET : 0) == REDIS_ERR) {
+            redisLog(REDIS_WARNING, "Error allocating resources for the client");
+            close(cfd); /* May be already closed, just ignore errors */
+        }
+    }
+    if (accepted) {
+        latencyHistAdd(&server.acceptburst, accepted);
+        latencyHistAdd(&server.accepttime, ustime()-start);
+    }
+}
+
 static void acceptHandler(eEventLoop *el, int fd, void *privdata, int mask)
 {
     REDIS_NOTUSED(el);
     REDIS_NOTUSED(privdata);
     REDIS_NOTUSED(mask);
-    int cport;
-    char cip[128];
-    int cfd = netAccept(server.neterr, fd, cip, &cport);
-    if (cfd == NET_ERR) {
-        redisLog(REDIS_DEBUG, "Accepting client connection: %s", server.neterr);
-        return;
-    }
-    redisLog(REDIS_DEBUG, "Accepted %s:%d", cip, cport);
-    if (createClient(cfd) == REDIS_ERR) {
-        redisLog(REDIS_WARNING, "Error allocating resources for the client");
-        close(cfd); /* May be already closed, just ignore errors */
-        return;
-    }
+    acceptGenericHandler(fd, 0);
+}
+
+static void acceptUnixHandler(eEventLoop *el, int fd, void *privdata, int mask)
+{
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(privdata);
+    REDIS_NOTUSED(mask);
+    acceptGenericHandler(fd, 1);
 }
 
 /*============================= Commands ============================== */
@@ -1038,7 +2397,7 @@ static void pingCommand(redisClient *client)
 
 static void echoCommand(redisClient *client)
 {
-    addReplySds(client, sdscatprintf(sdsempty(), "%d\r\n", (int)sdslen(client->argv[1])));
+    addReplyLongLong(client, sdslen(client->argv[1]));
     addReplySds(client, client->argv[1]);
     addReply(client, sharedObjs.crlf);
     client->argv[1] = NULL;
@@ -1079,11 +2438,38 @@ static void getCommand(redisClient *client)
         redisObject *obj = dictGetEntryVal(de);
         if (obj->type != REDIS_STRING) {
             char *err = "GET against key not holding a string value";
-            addReplySds(client, sdscatprintf(sdsempty(),"%d\r\n%s\r\n", -((int)strlen(err)), err));
+            addReplyBulkError(client, err);
         } else {
-            addReplySds(client, sdscatprintf(sdsempty(), "%d\r\n", (int)sdslen(obj->ptr)));
-            addReply(client, obj);
+            addReplyBulk(client, obj);
+        }
+    }
+}
+
+/* Command procs can't free the client, it is closed before the next
+ * event loop sleep */
+static void quitCommand(redisClient *client)
+{
+    freeClientAsync(client);
+}
+
+static void mgetCommand(redisClient *client)
+{
+    /* In shard mode the world is stopped if the keys are in more than one
+     * shard. Objects are never shared by two shards: the values of the
+     * other shards are copied in the reply. */
+    addReplyLongLong(client, client->argc-1);
+    for (int j = 1; j < client->argc; j++) {
+        int shard = keyShard(client->argv[j]);
+        dictEntry *de = dictFind(shardServers[shard]->dict[client->dictid], client->argv[j]);
+        redisObject *obj = de ? dictGetEntryVal(de) : NULL;
+        if (obj == NULL || obj->type != REDIS_STRING) {
+            addReply(client, sharedObjs.nil);
+        } else if (shard != server.shardid) {
+            addReplyLongLong(client, sdslen(obj->ptr));
+            addReplyString(client, obj->ptr, sdslen(obj->ptr));
             addReply(client, sharedObjs.crlf);
+        } else {
+            addReplyBulk(client, obj);
         }
     }
 }
@@ -1113,8 +2499,9 @@ static void incrDecrCommand(redisClient *client, int incr)
         else value = strtoll(obj->ptr, NULL, 10);
     }
     value += incr;
-    sds newval = sdscatprintf(sdsempty(), "%lld", value);
-    redisObject *obj = createObject(REDIS_STRING, newval);
+    char buf[32];
+    int len = ll2string(buf, sizeof(buf), value);
+    redisObject *obj = createObject(REDIS_STRING, sdsnewlen(buf, len));
     int retval = dictAdd(client->dict, client->argv[1], obj);
     if (retval == DICT_ERR) dictReplace(client->dict, client->argv[1], obj);
     else client->argv[1] = NULL;  /* Now the key is in the hash entry, don't free it */
@@ -1142,47 +2529,60 @@ static void selectCommand(redisClient *client)
 
 static void randomkeyCommand(redisClient *client)
 {
-    dictEntry *de = dictGetRandomEntry(client->dict);
-    if (de == NULL) {
-        addReply(client, sharedObjs.crlf);
-    } else {
-        addReply(client, dictGetEntryVal(de));
+    /* Pick the shard first, with a probability proportional to its size */
+    unsigned long size = dbSize(client->dictid);
+    if (size == 0) {
         addReply(client, sharedObjs.crlf);
+        return;
     }
+    unsigned long r = random() % size;
+    dict *dict = NULL;
+    int s;
+    for (s = 0; s < server.shards; s++) {
+        dict = shardServers[s]->dict[client->dictid];
+        if (r < dictGetHashTableUsed(dict)) break;
+        r -= dictGetHashTableUsed(dict);
+    }
+    redisObject *obj = dictGetEntryVal(dictGetRandomEntry(dict));
+    /* The objects of the other shards are copied, see mgetCommand() */
+    if (s != server.shardid) addReplyString(client, obj->ptr, sdslen(obj->ptr));
+    else addReply(client, obj);
+    addReply(client, sharedObjs.crlf);
 }
 
 static void keysCommand(redisClient *client)
 {
     sds pattern = client->argv[1];
     int plen = sdslen(pattern);
-    dictIterator *di = dictGetIterator(client->dict);
     sds keys = sdsempty();
-    dictEntry *de;
-    while ((de = dictNext(di)) != NULL) {
-        sds key = dictGetEntryKey(de);
-        if ((pattern[0] == '*' && pattern[1] == '\0') ||
-            stringmatchlen(pattern, plen, key, sdslen(key), 0)) {
-            keys = sdscat(keys, key);
-            keys = sdscatlen(keys, " ", 1);
+    for (int s = 0; s < server.shards; s++) {
+        dictIterator *di = dictGetIterator(shardServers[s]->dict[client->dictid]);
+        if (!di) oom("dictGetIterator");
+        dictEntry *de;
+        while ((de = dictNext(di)) != NULL) {
+            sds key = dictGetEntryKey(de);
+            if ((pattern[0] == '*' && pattern[1] == '\0') ||
+                stringmatchlen(pattern, plen, key, sdslen(key), 0)) {
+                keys = sdscat(keys, key);
+                keys = sdscatlen(keys, " ", 1);
+            }
         }
+        dictReleaseIterator(di);
     }
-    dictReleaseIterator(di);
     keys = sdstrim(keys, " ");
-    sds reply = sdscatprintf(sdsempty(), "%lu\r\n", sdslen(keys));
-    reply = sdscat(reply, keys);
-    reply = sdscatlen(reply, "\r\n", 2);
-    sdsfree(keys);
-    addReplySds(client, reply);
+    addReplyLongLong(client, sdslen(keys));
+    addReplySds(client, keys);
+    addReply(client, sharedObjs.crlf);
 }
 
 static void dbsizeCommand(redisClient *client)
 {
-    addReplySds(client, sdscatprintf(sdsempty(), "%lu\r\n", dictGetHashTableUsed(client->dict)));
+    addReplyLongLong(client, dbSize(client->dictid));
 }
 
 static void lastsaveCommand(redisClient *client)
 {
-    addReplySds(client, sdscatprintf(sdsempty(), "%lu\r\n", server.lastsave));
+    addReplyLongLong(client, server.lastsave);
 }
 
 static void saveCommand(redisClient *client)
@@ -1205,6 +2605,7 @@ static void shutdownCommand(redisClient *client)
 {
     redisLog(REDIS_WARNING, "User requested shutdown, saving DB...");
     if (saveDb("dump.rdb") == REDIS_OK) {
+        if (server.unixsocket) unlink(server.unixsocket);
         redisLog(REDIS_WARNING, "Server exit now, bye bye...");
         exit(1);
     } else {
@@ -1217,12 +2618,13 @@ static void moveCommand(redisClient *client)
 {
     /* Obtain source and target DB pointers */
     dict *src = client->dict;
+    int srcid = client->dictid;
     if (selectDb(client, atoi(client->argv[2])) == REDIS_ERR) {
         addReplySds(client, sdsnew("-ERR target DB out of range\r\n"));
         return;
     }
     dict *dst = client->dict;
-    client->dict = src;
+    selectDb(client, srcid);
     /* If the user is moving using as target the same
      * DB as the source DB it is probably an error. */
     if (src == dst) {
@@ -1255,24 +2657,30 @@ static void renameGenericCommand(redisClient *client, int nx)
         addReplySds(client, sdsnew("-ERR src and dest key are the same\r\n"));
         return;
     }
-    dictEntry *de = dictFind(client->dict, client->argv[1]);
+    /* In shard mode the two keys may live in different shards */
+    dict *src = keyDict(client->argv[1], client->dictid);
+    dict *dst = keyDict(client->argv[2], client->dictid);
+    dictEntry *de = dictFind(src, client->argv[1]);
     if (de == NULL) {
         addReplySds(client, sdsnew("-ERR no such key\r\n"));
         return;
     }
     redisObject *obj = dictGetEntryVal(de);
-    incrRefCount(obj);
-    if (dictAdd(client->dict, client->argv[2], obj) == DICT_ERR) {
+    /* Objects are never shared by two shards: replies queued by the
+     * source shard may still reference this one. */
+    if (src != dst) obj = dupObject(obj);
+    else incrRefCount(obj);
+    if (dictAdd(dst, client->argv[2], obj) == DICT_ERR) {
         if (nx) {
             decrRefCount(obj);
             addReplySds(client, sdsnew("-ERR destination key exists\r\n"));
             return;
         }
-        dictReplace(client->dict, client->argv[2], obj);
+        dictReplace(dst, client->argv[2], obj);
     } else {
         client->argv[2] = NULL;
     }
-    dictDelete(client->dict, client->argv[1]);
+    dictDelete(src, client->argv[1]);
     server.dirty++;
     addReply(client, sharedObjs.ok);
 }
@@ -1340,7 +2748,7 @@ static void popGenericCommand(redisClient *client, int where)
         redisObject *obj = dictGetEntryVal(de);
         if (obj->type != REDIS_LIST) {
             char *err = "POP against key not holding a list value";
-            addReplySds(client, sdscatprintf(sdsempty(), "%d\r\n%s\r\n", -((int)strlen(err)), err));
+            addReplyBulkError(client, err);
         } else {
             list *list = obj->ptr;
             listNode *node;
@@ -1350,9 +2758,7 @@ static void popGenericCommand(redisClient *client, int where)
                 addReply(client, sharedObjs.nil);
             } else {
                 redisObject *ele = listNodeValue(node);
-                addReplySds(client, sdscatprintf(sdsempty(), "%d\r\n", (int)sdslen(ele->ptr)));
-                addReply(client, ele);
-                addReply(client, sharedObjs.crlf);
+                addReplyBulk(client, ele);
                 listDelNode(list, node);
                 server.dirty++;
             }
@@ -1382,7 +2788,7 @@ static void llenCommand(redisClient *client)
             addReplySds(client, sdsnew("-1\r\n"));
         } else {
         	list *l = obj->ptr;
-            addReplySds(client, sdscatprintf(sdsempty(), "%d\r\n", listLength(l)));
+            addReplyLongLong(client, listLength(l));
         }
     }
 }
@@ -1397,7 +2803,7 @@ static void lindexCommand(redisClient *client)
         redisObject *obj = dictGetEntryVal(de);
         if (obj->type != REDIS_LIST) {
             char *err = "LINDEX against key not holding a list value";
-            addReplySds(client, sdscatprintf(sdsempty(), "%d\r\n%s\r\n", -((int)strlen(err)), err));
+            addReplyBulkError(client, err);
         } else {
             list *list = obj->ptr;
             listNode *node = listIndex(list, index);
@@ -1405,9 +2811,7 @@ static void lindexCommand(redisClient *client)
                 addReply(client, sharedObjs.nil);
             } else {
                 redisObject *ele = listNodeValue(node);
-                addReplySds(client,sdscatprintf(sdsempty(), "%d\r\n", (int)sdslen(ele->ptr)));
-                addReply(client, ele);
-                addReply(client, sharedObjs.crlf);
+                addReplyBulk(client, ele);
             }
         }
     }
@@ -1422,7 +2826,7 @@ static void lrangeCommand(redisClient *client)
         redisObject *obj = dictGetEntryVal(de);
         if (obj->type != REDIS_LIST) {
             char *err = "LRANGE against key not holding a list value";
-            addReplySds(client, sdscatprintf(sdsempty(), "%d\r\n%s\r\n", -((int)strlen(err)), err));
+            addReplyBulkError(client, err);
         } else {
             list *list = obj->ptr;
             int llen = listLength(list);
@@ -1443,12 +2847,10 @@ static void lrangeCommand(redisClient *client)
             int rangelen = (end - start) + 1;
             /* Return the result in form of a multi-bulk reply */
             listNode *node = listIndex(list, start);
-            addReplySds(client, sdscatprintf(sdsempty(), "%d\r\n", rangelen));
+            addReplyLongLong(client, rangelen);
             for (int j = 0; j < rangelen; j++) {
             	redisObject *ele = listNodeValue(node);
-                addReplySds(client, sdscatprintf(sdsempty(), "%d\r\n", (int)sdslen(ele->ptr)));
-                addReply(client, ele);
-                addReply(client, sharedObjs.crlf);
+                addReplyBulk(client, ele);
                 node = node->next;
             }
         }
@@ -1499,10 +2901,383 @@ static void ltrimCommand(redisClient *client)
     }
 }
 
+static sds catLatencyHist(sds s, char *name, latencyHist *h)
+{
+    return sdscatprintf(s, "%s:count=%llu,avg=%llu,p50=%llu,p99=%llu,p999=%llu,max=%llu\r\n",
+        name, h->count, h->count ? h->sum/h->count : 0,
+        latencyHistPercentile(h, 0.5), latencyHistPercentile(h, 0.99),
+        latencyHistPercentile(h, 0.999), h->max);
+}
+
+/* Report the event loop latency histograms, in microseconds (percentiles
+ * are upper bounds of power of two buckets). */
+static void latencyCommand(redisClient *client)
+{
+    eLoopStats *st = &server.el->stats;
+    sds info = sdscatprintf(sdsempty(), "backend:%s\r\n", eGetApiName());
+    info = catLatencyHist(info, "iteration", &st->iteration);
+    info = catLatencyHist(info, "poll", &st->poll);
+    info = catLatencyHist(info, "file_callback", &st->fileProc);
+    info = catLatencyHist(info, "time_callback", &st->timeProc);
+    info = catLatencyHist(info, "events_per_iteration", &st->events);
+    info = catLatencyHist(info, "accept_burst", &server.acceptburst);
+    info = catLatencyHist(info, "accept_time", &server.accepttime);
+    info = sdscatprintf(info, "stall_threshold_ms:%d\r\nstalls:%llu\r\n",
+        server.stallthreshold, st->stalls);
+    info = sdscatprintf(info, "client_pool_hits:%llu\r\nclient_pool_misses:%llu\r\n",
+        server.clientpoolhits, server.clientpoolmisses);
+    addReplyLongLong(client, sdslen(info));
+    addReplySds(client, info);
+    addReply(client, sharedObjs.crlf);
+}
+
+/* ================================= Shards ================================= */
+
+/* With "shards N" the server runs N event loops on N threads, the main
+ * thread being the first one. Every shard thread has its own copy of the
+ * server state (server is thread local) and owns the keys hashing to it
+ * in every DB, see keyShard(). All the shards accept connections on the
+ * same port (SO_REUSEPORT). A command about a key owned by another shard
+ * is sent there as a call, the caller client waits for the reply before
+ * processing its next command. A multi key command is sent the same way
+ * if all its keys are owned by the same shard. The rare commands
+ * accessing the keys of more than one shard (KEYS, DBSIZE, SAVE, an MGET
+ * or RENAME across shards, ...) stop the world instead: the other shards
+ * are parked while the command runs. */
+
+static int shardQueuePush(shardQueue *q, shardMsg *msg)
+{
+    unsigned long tail = q->tail;
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == REDIS_SHARD_QUEUE_LEN) return 0;
+    q->msgs[tail & (REDIS_SHARD_QUEUE_LEN-1)] = msg;
+    __atomic_store_n(&q->tail, tail+1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static shardMsg *shardQueuePop(shardQueue *q)
+{
+    unsigned long head = q->head;
+    if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) return NULL;
+    shardMsg *msg = q->msgs[head & (REDIS_SHARD_QUEUE_LEN-1)];
+    __atomic_store_n(&q->head, head+1, __ATOMIC_RELEASE);
+    return msg;
+}
+
+/* Queue a message for another shard. It is actually woken up by
+ * shardFlush(), once per event loop iteration. */
+static void shardSend(int shard, shardMsg *msg)
+{
+    list *backlog = server.shardbacklog[shard];
+    if (listLength(backlog) ||
+        !shardQueuePush(shardQueues[server.shardid*server.shards+shard], msg)) {
+        if (!listAddNodeTail(backlog, msg)) oom("listAddNodeTail");
+    }
+    server.shardnotify[shard] = 1;
+}
+
+/* Move the backlogs in the queues and wake up the shards we sent
+ * something to. Returns the number of messages still in the backlogs. */
+static int shardFlush(void)
+{
+    int pending = 0;
+    for (int j = 0; j < server.shards; j++) {
+        if (j == server.shardid) continue;
+        list *backlog = server.shardbacklog[j];
+        shardQueue *q = shardQueues[server.shardid*server.shards+j];
+        listNode *node;
+        while ((node = listFirst(backlog)) != NULL && shardQueuePush(q, listNodeValue(node)))
+            listDelNode(backlog, node);
+        pending += listLength(backlog);
+        if (server.shardnotify[j]) {
+            server.shardnotify[j] = 0;
+            /* A full pipe is fine, the shard is going to wake up anyway */
+            if (write(shardServers[j]->shardpipe[1], "x", 1) == -1 && errno != EAGAIN)
+                redisLog(REDIS_WARNING, "Waking up shard %d: %s", j, strerror(errno));
+        }
+    }
+    return pending;
+}
+
+static long long shardsDirty(void)
+{
+    long long dirty = 0;
+    for (int s = 0; s < server.shards; s++)
+        dirty += __atomic_load_n(&shardServers[s]->dirty, __ATOMIC_RELAXED);
+    return dirty;
+}
+
+/* Park all the other shards, so their keys can be accessed. Returns
+ * once they are all parked, the world is resumed by resumeWorld().
+ *
+ * The shards stop the world in turn, by ticket: a shard resuming the
+ * world and stopping it again right away gets behind the ones already
+ * waiting, so none of them is starved. */
+static void stopWorld(void)
+{
+    if (server.shards == 1) return;
+    /* Other shards may be stopping the world before us, keep serving our
+     * queues so that we get parked by them until it is our turn. */
+    unsigned long ticket = __atomic_fetch_add(&world.ticket, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&world.turn, __ATOMIC_ACQUIRE) != ticket) {
+        shardProcessMessages();
+        sched_yield();
+    }
+    for (int j = 0; j < server.shards; j++) {
+        if (j == server.shardid) continue;
+        shardMsg *msg = malloc(sizeof(*msg));
+        if (!msg) oom("stopWorld");
+        msg->type = REDIS_SHARD_STOP;
+        shardSend(j, msg);
+    }
+    while (1) {
+        int pending = shardFlush();
+        pthread_mutex_lock(&world.lock);
+        if (world.parked == server.shards-1) {
+            pthread_mutex_unlock(&world.lock);
+            break;
+        }
+        if (!pending) pthread_cond_wait(&world.cond, &world.lock);
+        pthread_mutex_unlock(&world.lock);
+        if (pending) sched_yield();
+    }
+}
+
+static void resumeWorld(void)
+{
+    if (server.shards == 1) return;
+    pthread_mutex_lock(&world.lock);
+    world.parked = 0;
+    world.gen++;
+    pthread_cond_broadcast(&world.cond);
+    pthread_mutex_unlock(&world.lock);
+    __atomic_fetch_add(&world.turn, 1, __ATOMIC_RELEASE);
+}
+
+static void shardPark(void)
+{
+    pthread_mutex_lock(&world.lock);
+    unsigned long gen = world.gen;
+    world.parked++;
+    pthread_cond_broadcast(&world.cond);
+    while (gen == world.gen) pthread_cond_wait(&world.cond, &world.lock);
+    pthread_mutex_unlock(&world.lock);
+}
+
+/* Send the command of 'client' to the shard owning its key. The argv is
+ * moved to the call, the client waits for the reply. */
+static void shardCall(redisClient *client, struct redisCommand *cmd, int shard)
+{
+    shardMsg *msg = malloc(sizeof(*msg));
+    if (!msg) oom("shardCall");
+    msg->type = REDIS_SHARD_CALL;
+    msg->from = server.shardid;
+    msg->client = client;
+    msg->cmd = cmd;
+    msg->dictid = client->dictid;
+    msg->argc = client->argc;
+    msg->argv = client->argv;
+    msg->argvlen = client->argvlen;
+    msg->reply = NULL;
+    client->argv = NULL;
+    client->argc = client->argvlen = 0;
+    client->shardcall = msg;
+    client->flags |= REDIS_SHARD_WAIT;
+    shardSend(shard, msg);
+}
+
+/* Execute a call of another shard and send the reply back */
+static void shardExecCall(shardMsg *msg)
+{
+    redisClient *client = server.shardclient;
+    selectDb(client, msg->dictid);
+    freeClientArgvArray(client);
+    client->argv = msg->argv;
+    client->argc = msg->argc;
+    client->argvlen = msg->argvlen;
+    msg->argv = NULL;
+    msg->argc = 0;
+    call(client, msg->cmd, (msg->cmd->flags & REDIS_CMD_ADMIN) != 0);
+    freeClientArgv(client);
+    sds reply = sdsnewlen(client->buf, client->bufpos);
+    client->bufpos = 0;
+    listNode *node;
+    while ((node = listFirst(client->reply)) != NULL) {
+        redisObject *obj = listNodeValue(node);
+        reply = sdscatlen(reply, obj->ptr, sdslen(obj->ptr));
+        listDelNode(client->reply, node);
+    }
+    client->replybytes = 0;
+    msg->type = REDIS_SHARD_REPLY;
+    msg->reply = reply;
+    shardSend(msg->from, msg);
+}
+
+static void shardHandleReply(shardMsg *msg)
+{
+    redisClient *client = msg->client;
+    if (!client) {
+        /* The client was freed meanwhile */
+        sdsfree(msg->reply);
+        free(msg);
+        return;
+    }
+    client->shardcall = NULL;
+    client->flags &= ~REDIS_SHARD_WAIT;
+    addReplySds(client, msg->reply);
+    free(msg);
+    /* Go ahead with the commands pipelined in the meantime */
+    processInputBuffer(client);
+}
+
+static void shardProcessMessages(void)
+{
+    for (int j = 0; j < server.shards; j++) {
+        if (j == server.shardid) continue;
+        shardQueue *q = shardQueues[j*server.shards+server.shardid];
+        shardMsg *msg;
+        while ((msg = shardQueuePop(q)) != NULL) {
+            if (msg->type == REDIS_SHARD_CALL) {
+                shardExecCall(msg);
+            } else if (msg->type == REDIS_SHARD_REPLY) {
+                shardHandleReply(msg);
+            } else {
+                free(msg);
+                shardPark();
+            }
+        }
+    }
+}
+
+static void shardPipeHandler(eEventLoop *el, int fd, void *privdata, int mask)
+{
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(privdata);
+    REDIS_NOTUSED(mask);
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0);
+    server.currentcmd = NULL;
+    shardProcessMessages();
+}
+
+/* Called by initServer() in shard mode */
+static void initShard(void)
+{
+    if (pipe(server.shardpipe) == -1) {
+        redisLog(REDIS_WARNING, "Creating the shard pipe: %s", strerror(errno));
+        exit(1);
+    }
+    netNonBlock(NULL, server.shardpipe[0]);
+    netNonBlock(NULL, server.shardpipe[1]);
+    if (eCreateFileEvent(server.el, server.shardpipe[0], E_READABLE, shardPipeHandler, NULL, NULL) == E_ERR)
+        oom("creating file event");
+    server.shardbacklog = malloc(sizeof(list*)*server.shards);
+    server.shardnotify = calloc(server.shards, sizeof(int));
+    if (!server.shardbacklog || !server.shardnotify) oom("shard initialization");
+    for (int j = 0; j < server.shards; j++) {
+        if ((server.shardbacklog[j] = listCreate()) == NULL) oom("shard initialization");
+    }
+    /* The client executing the calls of the other shards */
+    redisClient *client = malloc(sizeof(struct redisClient));
+    if (!client) oom("shard initialization");
+    client->fd = -1;
+    selectDb(client, 0);
+    client->querybuf = sdsempty();
+    client->qbpos = 0;
+    client->querybufpeak = 0;
+    client->reqtype = 0;
+    client->multibulklen = 0;
+    client->argv = NULL;
+    client->argc = 0;
+    client->argvlen = 0;
+    client->bulklen = -1;
+    if ((client->reply = listCreate()) == NULL) oom("listCreate");
+    listSetFreeMethod(client->reply, decrRefCount);
+    client->sentlen = 0;
+    client->bufpos = 0;
+    client->replybytes = 0;
+    client->softlimitsince = 0;
+    client->flags = REDIS_SHARD_CLIENT;
+    client->shardcall = NULL;
+    client->zc = NULL;
+    client->lastinteraction = server.monotime;
+    client->clientsnode = client->idlenode = NULL;
+    client->pendingwritenode = client->pendingreadnode = client->closenode = NULL;
+    server.shardclient = client;
+}
+
+static void initServerLoop(void);
+
+static void *shardMain(void *arg)
+{
+    server = shardConfig;
+    server.shardid = (long) arg;
+    initServer();
+    pthread_barrier_wait(&shardBarrier); /* every shard is initialized */
+    pthread_barrier_wait(&shardBarrier); /* the DB is loaded */
+    initServerLoop();
+    eMain(server.el);
+    return NULL;
+}
+
+/* Start the shard threads and wait for them to be initialized. The main
+ * thread is the first shard. */
+static void startShards(void)
+{
+    if (server.shards == 1) return;
+    int n = server.shards;
+    shardQueues = calloc(n*n, sizeof(shardQueue*));
+    if (!shardQueues) oom("shards initialization");
+    for (int j = 0; j < n*n; j++) {
+        if (j/n == j%n) continue; /* no queue to self */
+        if ((shardQueues[j] = calloc(1, sizeof(shardQueue))) == NULL) oom("shards initialization");
+    }
+    pthread_barrier_init(&shardBarrier, NULL, n);
+    for (int j = 1; j < n; j++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, shardMain, (void*)(long)j) != 0) {
+            redisLog(REDIS_WARNING, "Can't create shard thread: %s", strerror(errno));
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&shardBarrier);
+    redisLog(REDIS_NOTICE, "%d shards started", n);
+}
+
+static void initServerLoop(void)
+{
+    if (eCreateFileEvent(server.el, server.fd, E_READABLE, acceptHandler, NULL, NULL) == E_ERR)
+    	oom("creating file event");
+    if (server.sofd != -1 &&
+        eCreateFileEvent(server.el, server.sofd, E_READABLE, acceptUnixHandler, NULL, NULL) == E_ERR)
+    	oom("creating file event");
+    eSetBeforeSleepProc(server.el, beforeSleep);
+    eSetAfterSleepProc(server.el, afterSleep);
+    eSetStallProc(server.el, (long long)server.stallthreshold*1000, stallHandler);
+}
+
+/* The kernel silently truncates the listen() backlog to somaxconn */
+static void checkTcpBacklog(void)
+{
+#ifdef __linux__
+    FILE *fp = fopen("/proc/sys/net/core/somaxconn", "r");
+    if (!fp) return;
+    int somaxconn;
+    if (fscanf(fp, "%d", &somaxconn) == 1 && somaxconn < server.tcpbacklog) {
+        redisLog(REDIS_WARNING, "The TCP backlog of %d can't be enforced, "
+            "/proc/sys/net/core/somaxconn is %d: using it", server.tcpbacklog, somaxconn);
+        server.tcpbacklog = somaxconn;
+    }
+    fclose(fp);
+#endif
+}
+
 /* ============================= Main! ============================== */
 int main(int argc, char **argv) {
 	initServerConfig();
-    initServer();
+    populateCommandTable();
+    /* The config is loaded before initServer(): the port, the number of
+     * DBs and of shards, the pool size... are used to initialize the
+     * server, and every shard starts from a copy of the configuration. */
     if (argc == 2) {
         ResetServerSaveParams();
         loadServerConfig(argv[1]);
@@ -1511,12 +3286,21 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Usage: ./redis-server [/path/to/redis.conf]\n");
         exit(1);
     }
-    redisLog(REDIS_NOTICE, "Server started");
+    if (server.shards > 1 && server.iothreads > 1) {
+        redisLog(REDIS_WARNING, "The shards and iothreads options can't be used together");
+        exit(1);
+    }
+    checkTcpBacklog();
+    shardConfig = server;
+    initServer();
+    startShards();
+    redisLog(REDIS_NOTICE, "Server started, event loop backend is %s", eGetApiName());
     if (loadDb("dump.rdb") == REDIS_OK)
         redisLog(REDIS_NOTICE, "DB loaded from disk");
-    if (eCreateFileEvent(server.el, server.fd, E_READABLE, acceptHandler, NULL, NULL) == E_ERR)
-    	oom("creating file event");
+    if (server.shards > 1) pthread_barrier_wait(&shardBarrier); /* let the shards go */
+    initServerLoop();
     redisLog(REDIS_NOTICE, "The server is now ready to accept connections");
+    initIOThreads();
     eMain(server.el);
     eDeleteEventLoop(server.el);
     return 0;
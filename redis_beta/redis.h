@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/wait.h>
@@ -13,7 +14,11 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "event.h"  /* Event driven programming library */
 #include "sds.h"     /* Dynamic safe strings */
@@ -21,6 +26,10 @@
 #include "dict.h"    /* Hash tables */
 #include "dlist.h"    /* Linked lists */
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 /* Error codes */
 #define REDIS_OK 0
 #define REDIS_ERR -1
@@ -28,11 +37,37 @@
 /* Static server configuration */
 #define REDIS_SERVERPORT 6379    /* TCP port */
 #define REDIS_MAXIDLETIME (60*5)  /* default client timeout */
-#define REDIS_QUERYBUF_LEN 1024
+#define REDIS_IOBUF_LEN (16*1024)  /* read size of the query buffer */
+#define REDIS_BIG_ARG (32*1024)    /* bulk arguments read straight in their sds */
+#define REDIS_QUERYBUF_LIMIT (1024*1024*1024) /* default max pending input */
+#define REDIS_QUERYBUF_IDLE 2      /* seconds before an idle query buffer is trimmed */
+#define REDIS_CLIENT_POOL 128      /* default max freed clients kept for reuse */
+#define REDIS_POOL_QUERYBUF_MAX (REDIS_IOBUF_LEN*4) /* bigger ones aren't pooled */
+#define REDIS_REPLY_CHUNK_BYTES (16*1024) /* static reply buffer of a client */
 #define REDIS_LOADBUF_LEN 1024
-#define REDIS_MAX_ARGS 16
+#define REDIS_INLINE_MAX (64*1024)  /* max length of an inline command line */
+#define REDIS_MULTIBULK_MAX (1024*1024) /* max arguments of a multi bulk command */
+#define REDIS_BULK_MAX (1024*1024*1024) /* max length of a bulk argument */
+#define REDIS_SPARE_ARGS 16        /* argument strings kept for the next command */
+#define REDIS_SPARE_ARG_SIZE 1024  /* max size of a kept argument string */
 #define REDIS_DEFAULT_DBNUM 16
 #define REDIS_CONFIGLINE_MAX 1024
+#define REDIS_STALL_THRESHOLD 100 /* default stall log threshold, ms */
+#define REDIS_TCP_BACKLOG 511     /* default listen() backlog */
+#define REDIS_MAX_ACCEPTS_PER_CALL 1000
+#define REDIS_DEFAULT_HZ 10       /* serverCron calls per second */
+#define REDIS_MAX_HZ 500
+#define REDIS_CRON_BUDGET 1000    /* default time budget of a cron job, usec */
+#define REDIS_CRON_BUSY_SPEEDUP 10 /* cron speed up with pending work */
+#define REDIS_CLIENTS_CRON_MIN_ITERATIONS 50
+#define REDIS_IOTHREADS_MAX 128
+#define REDIS_OUTPUT_HARD_LIMIT (256*1024*1024) /* default output buffer limits */
+#define REDIS_OUTPUT_SOFT_LIMIT (64*1024*1024)
+#define REDIS_OUTPUT_SOFT_SECONDS 60
+#define REDIS_ZEROCOPY_ORPHAN_TIMEOUT 30 /* max wait for the sends of freed clients */
+#define REDIS_SHARED_INTEGERS 1024 /* "<n>\r\n" reply lines preformatted */
+#define REDIS_SHARDS_MAX 64
+#define REDIS_SHARD_QUEUE_LEN 1024 /* must be a power of two */
 
 /* Hash table parameters */
 #define REDIS_HT_MINFILL 10      /* Minimal hash table fill 10% */
@@ -42,6 +77,19 @@
 #define REDIS_CMD_BULK 1
 #define REDIS_CMD_INLINE 0
 
+/* Request types, from the first byte of the command */
+#define REDIS_REQ_INLINE 1    /* space separated, with an optional final bulk */
+#define REDIS_REQ_MULTIBULK 2 /* *<argc>\r\n then $<len>\r\n<arg>\r\n per argument */
+
+/* Command flags. The keys of a command are given by its key positions,
+ * see struct redisCommand */
+#define REDIS_CMD_NOKEY 1     /* doesn't access the keyspace */
+#define REDIS_CMD_MULTIKEY 2  /* may access the keys of every shard */
+#define REDIS_CMD_ADMIN 4     /* save state, runs on shard 0 (multi key) */
+#define REDIS_CMD_WRITE 8     /* may modify the keyspace */
+#define REDIS_CMD_READONLY 16 /* only reads the keyspace */
+#define REDIS_CMD_DENYOOM 32  /* may use more memory, to deny when out of memory */
+
 /* Object types */
 #define REDIS_STRING 0
 #define REDIS_LIST 1
@@ -58,6 +106,29 @@
 #define REDIS_NOTICE 1
 #define REDIS_WARNING 2
 
+/* Client flags */
+#define REDIS_PENDING_WRITE 1 /* queued in server.clients_pending_write */
+#define REDIS_PENDING_READ 2  /* queued in server.clients_pending_read */
+#define REDIS_SHARD_CLIENT 4  /* fake client executing calls of other shards */
+#define REDIS_SHARD_WAIT 8    /* waiting for the reply of another shard */
+#define REDIS_UNIX_SOCKET 16  /* connected to the unix socket, not TCP */
+#define REDIS_CLOSE_ASAP 32   /* queued in server.clients_to_close */
+#define REDIS_READ_PAUSED 64  /* over the soft output limit, not read */
+
+/* Client classes, every one has its own output buffer limits */
+#define REDIS_CLIENT_TCP 0
+#define REDIS_CLIENT_UNIX 1
+#define REDIS_CLIENT_CLASSES 2
+
+/* Shard messages */
+#define REDIS_SHARD_CALL 0    /* run a command on the shard owning its key */
+#define REDIS_SHARD_REPLY 1   /* the reply of a call, back to the caller */
+#define REDIS_SHARD_STOP 2    /* park until the world is resumed */
+
+/* I/O threads operations */
+#define REDIS_IO_READ 0
+#define REDIS_IO_WRITE 1
+
 /* Anti-warning macro... */
 #define REDIS_NOTUSED(V) ((void) V)
 
@@ -69,12 +140,35 @@ typedef struct redisClient {
     int fd;
     dict *dict;
     sds querybuf;
-    sds argv[REDIS_MAX_ARGS];
+    size_t qbpos;   /* bytes of querybuf already parsed */
+    size_t querybufpeak; /* max querybuf length since the last trim check */
+    int reqtype;    /* REDIS_REQ_*, 0 until the first byte of the command */
+    int multibulklen; /* multi bulk arguments still to parse */
+    sds *argv;      /* strings in argv[argc..argvlen-1] are spare, or NULL */
     int argc;
+    int argvlen;    /* slots allocated in argv */
     int bulklen;    /* bulk read len. -1 if not in bulk read mode */
-    list *reply;
-    int sentlen;
-    time_t lastinteraction; /* time of the last interaction, used for timeout */
+    list *reply;    /* replies not fitting in buf, sent after it */
+    int sentlen;    /* bytes sent of buf, or of the first reply object */
+    unsigned long long replybytes; /* bytes of the objects in the reply list */
+    time_t softlimitsince; /* when the soft output limit was reached, or 0 */
+    int bufpos;
+    int flags;      /* REDIS_PENDING_WRITE, ... */
+    int ionread;    /* result of the last socket read */
+    int iowritten;  /* bytes written by the last socket write */
+    int iosentobjs; /* reply objects fully sent by the last socket write */
+    int ioerrno;    /* errno of the last failed socket read/write, or 0 */
+    int dictid;     /* index of the selected DB */
+    struct shardMsg *shardcall; /* call waiting for another shard, or NULL */
+    struct zeroCopyState *zc;   /* NULL if MSG_ZEROCOPY is not used */
+    time_t lastinteraction; /* server.monotime of the last interaction, for timeout */
+    /* Nodes of the client in the server lists, to unlink it in O(1) */
+    listNode *clientsnode;      /* in server.clients */
+    listNode *idlenode;         /* in server.idleclients */
+    listNode *pendingwritenode; /* in server.clients_pending_write, or NULL */
+    listNode *pendingreadnode;  /* in server.clients_pending_read, or NULL */
+    listNode *closenode;        /* in server.clients_to_close, or NULL */
+    char buf[REDIS_REPLY_CHUNK_BYTES]; /* small replies are copied here */
 } redisClient;
 
 /* A redis object, that is a type able to hold a string / list / set */
@@ -84,6 +178,31 @@ typedef struct redisObject {
     int refcount;
 } redisObject;
 
+/* MSG_ZEROCOPY state of a client. The kernel reads the values sent from
+ * our memory until it reports the send completed, so the objects are
+ * pinned meanwhile. Sends are counted, a pin is released when 'done'
+ * reaches the number of sends issued before it was taken. */
+typedef struct zeroCopyState {
+    int fd;
+    size_t threshold;           /* server.zerocopythreshold, for the I/O threads */
+    unsigned int seq;           /* sends issued */
+    unsigned int done;          /* sends completed */
+    list *pins;                 /* zeroCopyPin, by increasing seq */
+    time_t orphaned;            /* when the client was freed, see freeClient() */
+} zeroCopyState;
+
+typedef struct zeroCopyPin {
+    redisObject *obj;
+    unsigned int seq;
+} zeroCopyPin;
+
+/* Output buffer limits of a client class, in bytes. 0 = no limit */
+struct outputLimit {
+    unsigned long long hard;    /* the client is closed right away */
+    unsigned long long soft;    /* reading from the client is paused */
+    time_t softseconds;         /* closed if over soft for this long, 0 = never */
+};
+
 /* Save after XX time and  XX change */
 struct saveParam {
     time_t seconds;
@@ -94,13 +213,36 @@ struct saveParam {
 struct redisServer {
     int port;
     int fd;
+    int tcpbacklog;
+    char *unixsocket;           /* unix socket path, NULL = don't listen */
+    mode_t unixsocketperm;      /* unix socket file permissions, 0 = umask */
+    int sofd;                   /* unix socket listener, or -1 */
+    latencyHist acceptburst;    /* connections accepted per accept event */
+    latencyHist accepttime;     /* time spent accepting a burst, usec */
     dict **dict;
     long long dirty;            /* changes to DB from the last save */
     list *clients;
+    list *idleclients;          /* clients by last interaction, oldest first */
+    redisClient **clientsbyfd;  /* connected clients by fd, see linkClient() */
+    int clientsbyfdsize;
+    redisClient **clientpool;   /* freed clients to reuse, see allocClient() */
+    int clientpoollen;
+    int clientpoolsize;         /* max pooled clients, 0 = no pool */
+    unsigned long long clientpoolhits;   /* clients created from the pool */
+    unsigned long long clientpoolmisses; /* clients allocated */
+    list *clients_pending_write; /* clients with replies to flush before sleep */
+    list *clients_pending_read;  /* clients to read from before sleep (I/O threads) */
+    list *clients_to_close;      /* clients to free before sleep */
+    long long querybuflimit;     /* max unparsed input of a client */
+    struct outputLimit outputlimits[REDIS_CLIENT_CLASSES];
     char neterr[NET_ERR_LEN];
     eEventLoop *el;
     int verbosity;
     int cronloops;
+    int hz;                     /* serverCron frequency */
+    long long cronbudget;       /* time budget of every cron job, usec */
+    int cronresizedb;           /* next DB checked by the resize job */
+    long long cronlastlog;      /* mstime of the last stats log */
     int maxidletime;
     int dbnum;
     list *objfreelist;          /* A list of freed objects to avoid malloc() */
@@ -109,18 +251,65 @@ struct redisServer {
     struct saveParam *saveparams;
     int saveparamslen;
     char *logfile;
+    int stallthreshold;         /* log callbacks slower than this, ms. 0 = off */
+    long long cronid;           /* serverCron time event ID */
+    char *currentcmd;           /* last command run by the current callback */
+    time_t unixtime;            /* cached clock, see updateCachedTime() */
+    time_t monotime;            /* cached monotonic clock, for idle times */
+    long long mstime;           /* cached clock in milliseconds */
+    long long zerocopythreshold; /* replies this big use MSG_ZEROCOPY, 0 = never */
+    list *zcorphans;            /* zeroCopyState of freed clients, sends in flight */
+    int iothreads;              /* I/O threads, the main thread included */
+    redisClient **iojobs;       /* clients of the current I/O job */
+    int iojobslen, iojobssize;
+    /* Shard mode. Every shard thread has its own copy of this structure */
+    int shards;                 /* number of shards, 1 = shard mode disabled */
+    int shardid;
+    int shardpipe[2];           /* written to wake up the shard */
+    struct redisClient *shardclient; /* runs the calls of the other shards */
+    list **shardbacklog;        /* per target shard, messages not queued yet */
+    int *shardnotify;           /* per target shard, needs a wake up */
 };
 
 typedef void redisCommandProc(redisClient *client);
 struct redisCommand {
     char *name;
     redisCommandProc *proc;
-    int argc;
+    int argc;       /* arity, -N means at least N arguments */
     int type;
+    int flags;      /* REDIS_CMD_WRITE, ... */
+    int firstkey;   /* argv index of the first key, 0 = no keys */
+    int lastkey;    /* argv index of the last key, -1 = the last argument */
+    int keystep;    /* distance between two keys */
 };
 
-struct sharedObjects {
+/* A message between two shards. A call is sent to the shard owning the
+ * key, executed there and sent back as a reply to the caller. */
+typedef struct shardMsg {
+    int type;
+    int from;                   /* caller shard */
+    redisClient *client;        /* caller, NULL if freed. Caller shard only */
+    struct redisCommand *cmd;
+    int dictid;
+    int argc;
+    sds *argv;                  /* the argv of the caller, moved to the callee */
+    int argvlen;
+    sds reply;
+} shardMsg;
+
+/* Single producer / single consumer ring of messages. There is one for
+ * every (from, to) shards pair, so no locking is needed. */
+typedef struct shardQueue {
+    unsigned long head;         /* written by the consumer only */
+    char pad[64-sizeof(unsigned long)]; /* keep head and tail on two cache lines */
+    unsigned long tail;         /* written by the producer only */
+    shardMsg *msgs[REDIS_SHARD_QUEUE_LEN];
+} shardQueue;
+
+/* Shared objects are per shard thread, their refcount is not atomic */
+static __thread struct sharedObjects {
     redisObject *crlf, *ok, *err, *zerobulk, *nil, *zero, *one, *pong;
+    redisObject *integers[REDIS_SHARED_INTEGERS]; /* integers and bulk lengths */
 } sharedObjs;
 
 #endif /* REDIS_H_ */
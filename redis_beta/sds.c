@@ -67,6 +67,11 @@ sds sdsnew(const char *init)
     return sdsnewlen(init, initlen);
 }
 
+sds sdsdup(const sds s)
+{
+    return sdsnewlen(s, sdslen(s));
+}
+
 size_t sdslen(const sds s)
 {
     struct sdshdr *sh = (void*) (s - sizeof(struct sdshdr));
@@ -93,12 +98,29 @@ void sdsupdatelen(sds s)
     sh->len = reallen;
 }
 
-static sds sdsMakeRoomFor(sds s, size_t addlen)
+/* Make the string empty, keeping its memory */
+void sdsclear(sds s)
+{
+    struct sdshdr *sh = (void*) (s - sizeof(struct sdshdr));
+    sh->free += sh->len;
+    sh->len = 0;
+    sh->buf[0] = '\0';
+}
+
+/* Enlarge the free space at the end of the string, so that the caller
+ * can write addlen bytes there. If greedy more room than needed is
+ * taken, so that appending many times takes few reallocations: the
+ * length is doubled, but a big string only grows of SDS_MAX_PREALLOC. */
+static sds sdsMakeRoomForGeneric(sds s, size_t addlen, int greedy)
 {
     size_t free = sdsavail(s);
     if (free >= addlen) return s;
     size_t len = sdslen(s);
-    size_t newlen = (len + addlen) * 2;
+    size_t newlen = len + addlen;
+    if (greedy) {
+        if (newlen < SDS_MAX_PREALLOC) newlen *= 2;
+        else newlen += SDS_MAX_PREALLOC;
+    }
     struct sdshdr *sh = (void*) (s - sizeof(struct sdshdr));
     struct sdshdr *newsh = realloc(sh, sizeof(struct sdshdr) + newlen + 1);
 #ifdef SDS_ABORT_ON_OOM
@@ -110,6 +132,46 @@ static sds sdsMakeRoomFor(sds s, size_t addlen)
     return newsh->buf;
 }
 
+sds sdsMakeRoomFor(sds s, size_t addlen)
+{
+    return sdsMakeRoomForGeneric(s, addlen, 1);
+}
+
+/* Like sdsMakeRoomFor() but takes just the room asked for */
+sds sdsMakeRoomForExact(sds s, size_t addlen)
+{
+    return sdsMakeRoomForGeneric(s, addlen, 0);
+}
+
+/* Fix the length after the caller wrote 'incr' bytes at the end of the
+ * string, in the space made by sdsMakeRoomFor(). A negative 'incr'
+ * trims the string. */
+void sdsIncrLen(sds s, long incr)
+{
+    struct sdshdr *sh = (void*) (s - sizeof(struct sdshdr));
+    sh->len += incr;
+    sh->free -= incr;
+    s[sh->len] = '\0';
+}
+
+/* Release the free space at the end of the string */
+sds sdsRemoveFreeSpace(sds s)
+{
+    struct sdshdr *sh = (void*) (s - sizeof(struct sdshdr));
+    if (sh->free == 0) return s;
+    struct sdshdr *newsh = realloc(sh, sizeof(struct sdshdr) + sh->len + 1);
+    if (newsh == NULL) return s; /* still valid, just bigger */
+    newsh->free = 0;
+    return newsh->buf;
+}
+
+/* Bytes allocated for the string, header included */
+size_t sdsAllocSize(sds s)
+{
+    struct sdshdr *sh = (void*) (s - sizeof(struct sdshdr));
+    return sizeof(*sh) + sh->len + sh->free + 1;
+}
+
 sds sdscatlen(sds s, void *t, size_t len)
 {
     size_t curlen = sdslen(s);
@@ -123,6 +185,23 @@ sds sdscatlen(sds s, void *t, size_t len)
     return s;
 }
 
+/* Set the string to the 'len' bytes at 't', in its memory if it is
+ * big enough */
+sds sdscpylen(sds s, const char *t, size_t len)
+{
+    struct sdshdr *sh = (void*) (s - sizeof(struct sdshdr));
+    if ((size_t)(sh->len + sh->free) < len) {
+        s = sdsMakeRoomForExact(s, len - sh->len);
+        if (s == NULL) return NULL;
+        sh = (void*) (s - sizeof(struct sdshdr));
+    }
+    memcpy(s, t, len);
+    s[len] = '\0';
+    sh->free += sh->len - len;
+    sh->len = len;
+    return s;
+}
+
 sds sdscat(sds s, char *t)
 {
     return sdscatlen(s, t, strlen(t));
@@ -130,7 +209,7 @@ sds sdscat(sds s, char *t)
 
 sds sdscatprintf(sds s, const char *fmt, ...)
 {
-    va_list ap;
+    va_list ap, cpy;
     va_start(ap, fmt);
     char *buf;
     size_t buflen = 32;
@@ -142,7 +221,9 @@ sds sdscatprintf(sds s, const char *fmt, ...)
         if (buf == NULL) return NULL;
 #endif
         buf[buflen-2] = '\0';
-        vsnprintf(buf, buflen, fmt, ap);
+        va_copy(cpy, ap);
+        vsnprintf(buf, buflen, fmt, cpy);
+        va_end(cpy);
         if (buf[buflen-2] != '\0') {
             free(buf);
             buflen *= 2;
@@ -30,6 +30,8 @@
 
 #include <sys/types.h>
 
+#define SDS_MAX_PREALLOC (1024*1024) /* see sdsMakeRoomFor() */
+
 typedef char *sds;  // simple dynamic string
 // advantage: 1. strlen O(1) 2. append 3. no assumption about its terminal flag
 struct sdshdr {
@@ -41,11 +43,19 @@ struct sdshdr {
 sds sdsnewlen(const void *init, size_t initlen);
 sds sdsempty();
 sds sdsnew(const char *init);
+sds sdsdup(const sds s);
 size_t sdslen(const sds s);
 void sdsfree(sds s);
 size_t sdsavail(sds s);
 void sdsupdatelen(sds s);
+void sdsclear(sds s);
+sds sdsMakeRoomFor(sds s, size_t addlen);
+sds sdsMakeRoomForExact(sds s, size_t addlen);
+void sdsIncrLen(sds s, long incr);
+sds sdsRemoveFreeSpace(sds s);
+size_t sdsAllocSize(sds s);
 sds sdscatlen(sds s, void *t, size_t len);
+sds sdscpylen(sds s, const char *t, size_t len);
 sds sdscat(sds s, char *t);
 sds sdscatprintf(sds s, const char *fmt, ...);
 sds sdstrim(sds s, const char *cset);
@@ -357,6 +357,27 @@ proc main {server port} {
         redis_lrange $fd mylist 0 -1
     } {99 98 97 96 95}
 
+    test {Multi bulk SET and GET with a binary key} {
+        redis_multibulk $fd SET "key with spaces\r\n" "binary\0value"
+        redis_read_retcode $fd
+        redis_multibulk $fd GET "key with spaces\r\n"
+        set res [redis_bulk_read $fd]
+        redis_multibulk $fd DEL "key with spaces\r\n"
+        redis_read_integer $fd
+        format $res
+    } "binary\0value"
+
+    test {MGET} {
+        redis_set $fd foo BAR
+        redis_set $fd bar FOO
+        redis_mget $fd foo bar nosuchkey
+    } {BAR FOO {}}
+
+    test {LATENCY reports the event loop histograms} {
+        set res [redis_latency $fd]
+        list [string match {*iteration:count=*} $res] [string match {*stalls:*} $res]
+    } {1 1}
+
     # Leave the user with a clean DB before to exit
     test {DEL all keys again (DB 0)} {
         foreach key [redis_keys $fd *] {
@@ -376,6 +397,137 @@ proc main {server port} {
     } {0}
 
 
+    # The next tests run on servers of their own, started with the
+    # configuration under test.
+    set port [expr {$port+1}]
+    set pid [start_server $server $port {shards 4}]
+
+    test {MGET with keys on every shard} {
+        set sfd [redis_connect $server $port]
+        set keys {}
+        set vals {}
+        for {set j 0} {$j < 50} {incr j} {
+            redis_set $sfd key:$j val:$j
+            lappend keys key:$j
+            lappend vals val:$j
+        }
+        set res [redis_mget $sfd {*}$keys nosuchkey]
+        close $sfd
+        expr {$res eq [concat $vals {{}}]}
+    } {1}
+
+    test {MGET of a single shard} {
+        set sfd [redis_connect $server $port]
+        set res [redis_mget $sfd key:7 key:7 key:7]
+        close $sfd
+        format $res
+    } {val:7 val:7 val:7}
+
+    test {MGET of big values of other shards while they are replaced} {
+        set sfd [redis_connect $server $port]
+        set wfd [redis_connect $server $port]
+        set big {}
+        for {set j 0} {$j < 4} {incr j} {
+            lappend big [string repeat $j 20000]
+            redis_set $sfd big:$j [lindex $big $j]
+        }
+        for {set j 0} {$j < 20} {incr j} {
+            redis_write $sfd "mget big:0 big:1 big:2 big:3\r\n"
+            redis_write $wfd "set big:[expr {$j%4}] 20000\r\n[lindex $big [expr {$j%4}]]\r\n"
+        }
+        flush $sfd
+        flush $wfd
+        set ok 0
+        for {set j 0} {$j < 20} {incr j} {
+            if {[redis_multi_bulk_read $sfd] eq $big} {incr ok}
+            redis_read_retcode $wfd
+        }
+        close $sfd
+        close $wfd
+        format $ok
+    } {20}
+
+    test {Concurrent MGETs of keys on every shard from many clients} {
+        set fds {}
+        for {set c 0} {$c < 8} {incr c} {
+            lappend fds [redis_connect $server $port]
+        }
+        foreach cfd $fds {
+            for {set j 0} {$j < 100} {incr j} {
+                redis_write $cfd "mget $keys\r\n"
+            }
+            flush $cfd
+        }
+        set ok 0
+        foreach cfd $fds {
+            for {set j 0} {$j < 100} {incr j} {
+                if {[redis_multi_bulk_read $cfd] eq $vals} {incr ok}
+            }
+            close $cfd
+        }
+        format $ok
+    } {800}
+
+    test {Concurrent MGETs of keys on every shard are served fairly} {
+        set fds {}
+        set ::mgetcount {}
+        for {set c 0} {$c < 16} {incr c} {
+            set cfd [redis_connect $server $port]
+            lappend fds $cfd
+            lappend ::mgetcount 0
+            fileevent $cfd readable [list mget_loop $cfd $c $keys]
+            redis_writenl $cfd "mget $keys"
+        }
+        after 2000 {set ::mgetdone 1}
+        vwait ::mgetdone
+        foreach cfd $fds {close $cfd}
+        set min [tcl::mathfunc::min {*}$::mgetcount]
+        set max [tcl::mathfunc::max {*}$::mgetcount]
+        expr {$min*100 > $max}
+    } {1}
+
+    test {RENAME across shards} {
+        set sfd [redis_connect $server $port]
+        for {set j 0} {$j < 20} {incr j} {
+            redis_rename $sfd key:$j renamed:$j
+        }
+        set res [redis_mget $sfd key:0 renamed:0 renamed:19]
+        lappend res [redis_dbsize $sfd]
+        close $sfd
+        format $res
+    } {{} val:0 val:19 54}
+
+    kill_server $port $pid
+
+    set pid [start_server $server $port {iothreads 4} {zerocopythreshold 10000}]
+
+    test {Big replies with I/O threads and zero copy} {
+        set fds {}
+        for {set c 0} {$c < 8} {incr c} {
+            lappend fds [redis_connect $server $port]
+        }
+        set big [string repeat x 50000]
+        redis_set [lindex $fds 0] big $big
+        redis_set [lindex $fds 0] small 1
+        foreach cfd $fds {
+            for {set j 0} {$j < 20} {incr j} {
+                redis_write $cfd "get small\r\nget big\r\n"
+            }
+            flush $cfd
+        }
+        set ok 0
+        foreach cfd $fds {
+            for {set j 0} {$j < 20} {incr j} {
+                if {[redis_bulk_read $cfd] eq {1} &&
+                    [redis_bulk_read $cfd] eq $big} {incr ok}
+            }
+            close $cfd
+        }
+        format $ok
+    } {160}
+
+    kill_server $port $pid
+
     puts "\n[expr $::passed+$::failed] tests, $::passed passed, $::failed failed"
     if {$::failed > 0} {
         puts "\n*** WARNING!!! $::failed FAILED TESTS ***\n"
@@ -389,6 +541,37 @@ proc redis_connect {server port} {
     return $fd
 }
 
+# Start a server listening on 'port' with the given config directives, in
+# a directory of its own so it doesn't load or save our dump.rdb
+proc start_server {server port args} {
+    set dir [file join /tmp redis-test-[pid]-$port]
+    file mkdir $dir
+    set fp [open [file join $dir redis.conf] w]
+    puts $fp "port $port\ndir $dir\nloglevel warning"
+    foreach directive $args {puts $fp $directive}
+    close $fp
+    set pid [exec [file join [pwd] redis-server] [file join $dir redis.conf] \
+        >& [file join $dir log] &]
+    for {set j 0} {$j < 50} {incr j} {
+        if {![catch {close [socket $server $port]}]} {return $pid}
+        after 100
+    }
+    error "Can't start the server on port $port"
+}
+
+proc kill_server {port pid} {
+    catch {exec kill $pid}
+    after 100
+    file delete -force [file join /tmp redis-test-[pid]-$port]
+}
+
+# Count the MGET replies of a client, and send the next MGET
+proc mget_loop {fd idx keys} {
+    redis_multi_bulk_read $fd
+    lset ::mgetcount $idx [expr {[lindex $::mgetcount $idx]+1}]
+    redis_writenl $fd "mget $keys"
+}
+
 proc redis_write {fd buf} {
     puts -nonewline $fd $buf
 }
@@ -430,6 +613,15 @@ proc redis_multi_bulk_read fd {
     return $l
 }
 
+proc redis_multibulk {fd args} {
+    set buf "*[llength $args]\r\n"
+    foreach arg $args {
+        append buf "\$[string length $arg]\r\n$arg\r\n"
+    }
+    redis_write $fd $buf
+    flush $fd
+}
+
 proc redis_read_retcode fd {
     set retcode [string trim [gets $fd]]
     # puts "S: $retcode"
@@ -457,6 +649,11 @@ proc redis_get {fd key} {
     redis_bulk_read $fd
 }
 
+proc redis_mget {fd args} {
+    redis_writenl $fd "mget $args"
+    redis_multi_bulk_read $fd
+}
+
 proc redis_select {fd id} {
     redis_writenl $fd "select $id"
     redis_read_retcode $fd
@@ -547,6 +744,11 @@ proc redis_rpop {fd key} {
     redis_bulk_read $fd
 }
 
+proc redis_latency {fd} {
+    redis_writenl $fd "latency"
+    redis_bulk_read $fd
+}
+
 if {[llength $argv] == 0} {
     main 127.0.0.1 6379
 } else {